@@ -19,139 +19,2216 @@
  *    key = word
  *    value = frequency
  * 2) Once entire file is read, use quick sort algo to sort hash table array
+ *    i) when the full vocabulary is ranked (n >= number of distinct words),
+ *       use an LSD radix sort over packed 64-bit keys instead:
+ *       key = (inverted count << 32) | entry index
+ *       histogram and scatter passes are split across threads with OpenMP
+ *       (compile with -fopenmp, otherwise the sort runs single threaded)
  * 3) Return top n most frequent words from sorted hash table
+ * 4) Optionally (--stats) report corpus statistics from the same pass:
+ *    i) Heaps' law V = K * N^beta: number of distinct words V is recorded at
+ *       geometric token checkpoints N (HEAPS_CHECKPOINTS_PER_DOUBLING per
+ *       doubling), K and beta fitted by least squares in log-log space
+ *   ii) Zipf's law f(r) ~ r^-s: s fitted by least squares in log-log space on
+ *       the full rank-frequency array (ranks with count >= ZIPF_MIN_COUNT, the
+ *       flat tail of words seen once would otherwise dominate the fit)
+ * 5) Optionally (--memory-budget) bound the memory of the counting structures:
+ *    i) the table tracks the bytes of its buckets, nodes and word strings
+ *   ii) exact counting is used while the next new word still fits the budget
+ *  iii) once it would not, the table switches to approximate counting with the
+ *       Space-Saving algorithm: nodes are kept in a min-heap by count and a new
+ *       word replaces the least frequent node, inheriting its count + 1. The
+ *       count of any word is overestimated by at most the inherited count, and
+ *       every word with true frequency > tokens / nodes is kept. When the
+ *       new word is longer, further least frequent nodes are evicted until it
+ *       fits, so the budget is a hard bound (a word that does not fit even as
+ *       the only node is not kept)
+ *   iv) the report states which mode produced the result and the fixed
+ *       overhead of the table, a budget below the overhead of the table and
+ *       one node is rejected
+ *    v) an evicted word that comes back looks new to the table, and in
+ *       two-stage mode (8) a filter false positive hides a first sighting, so
+ *       with --stats and a budget or --two-stage distinct words are also
+ *       added to a HyperLogLog sketch of HLL_REGISTERS one byte registers
+ *       (~1.6% standard error). Once the table cannot count them the
+ *       distinct count and the Heaps' law checkpoints come from the sketch
+ *       and the report labels them as estimates
+ * 6) Optionally (--original-case) return the most common original form of each
+ *    word (e.g. "Rome" rather than "rome"):
+ *    i) while lowercasing, the tokenizer builds a bitmask of uppercase letters
+ *       (first 64 characters, longer words keep the rest lowercase)
+ *   ii) each node counts its CASE_VARIANTS most common masks in a fixed
+ *       array allocated with the node (only with this option), a mask not
+ *       tracked yet replaces the least frequent one and inherits its count + 1
+ *       (Space-Saving again), so no further allocation is needed
+ *  iii) the dominant form is rebuilt from the mask with the highest count
+ * 7) Optionally (--locations) return a sample of source locations per word:
+ *    i) the file is read in READ_BUFFER_SIZE blocks, the byte offset of each
+ *       word is known from its position in the block
+ *   ii) each node keeps LOCATION_SAMPLES slots, allocated with the node only
+ *       with this option, filled by reservoir sampling
+ *       (the k-th occurrence replaces a random slot with probability
+ *       LOCATION_SAMPLES / k) using a xorshift64* generator. k counts the
+ *       occurrences offered to the node's reservoir, not its count, which
+ *       includes a first sighting in two-stage mode or an inherited count
+ *  iii) line numbers are only needed when a sample is kept, so newlines are
+ *       counted lazily with SSE2 compares up to the word being sampled and to
+ *       the end of each block, one vector pass over the file in total
+ * 8) Optionally (--two-stage) keep words seen once out of the hash table:
+ *    i) a Bloom filter of BLOOM_BITS_PER_WORD bits per expected distinct word
+ *       (one per BLOOM_BYTES_PER_WORD bytes of the file, power of two, at
+ *       most half of the memory budget left after the table, none if that
+ *       cannot hold BLOOM_MIN_BITS) records first sightings, its
+ *       BLOOM_HASHES bit positions come from one FNV-1a 64 hash by double
+ *       hashing, h1 + i * h2
+ *   ii) a word missing from the table and the filter is only added to the
+ *       filter; on its second sighting it gets a node with count 2, counting
+ *       the first occurrence as well. In approximate mode it replaces the
+ *       least frequent node as in 5), the inherited count + 1 already covers
+ *       the first occurrence and the error bound of 5) is unchanged
+ *  iii) a false positive counts a word's first occurrence twice, the report
+ *       estimates the rate from the fraction of bits set. Words seen once are
+ *       not ranked, and their casing and location samples are not kept
+ * 9) Optionally (--build-index, --query-index) count any substring or phrase
+ *    of the corpus with a suffix array:
+ *    i) the corpus is normalized by the tokenizer above, lowercase words
+ *       joined by single spaces, queries are normalized the same way
+ *   ii) the suffix array is built by SA-IS (induced sorting, linear time),
+ *       and the LCP as the permuted PLCP[text position] with the Phi
+ *       algorithm, its chunks of text positions computed in parallel with
+ *       OpenMP, LCP[i] = PLCP[SA[i]] when needed. Both are instantiated by
+ *       macro for every symbol kind (bytes here, int32 token ids for
+ *       phrases, the reduced strings of the recursion) and entry width, so
+ *       no loop dispatches on either
+ *  iii) the index file is a header, the normalized text, SA and LCP (in SA
+ *       order), with 4-byte entries below 2^31 characters and 8-byte entries
+ *       above. The text is normalized straight into the file, which is then
+ *       mapped and the arrays are written into it. Queries map it read-only
+ *       and run in place, no parsing at startup
+ *   iv) count(query) is the width of the SA range of suffixes starting with
+ *       the query, two binary searches of O(m log n)
+ *    v) SA-IS runs in memory: SA and PLCP, 8 bytes per character below 2^31
+ *       characters (16 above), plus n / 8 bytes of type bits and the buckets
+ *       of its recursion, one entry per distinct LMS substring (at most n / 2,
+ *       far fewer in text). The text itself is read through the mapped file
+ *   vi) when that exceeds --memory-budget, the suffix array is built in
+ *       buckets instead, using the budget and the mapped file only:
+ *       - suffixes are counted in parallel by the key of their first two
+ *         symbols (SUFFIX_KEYS counters per thread), consecutive keys are
+ *         grouped into passes of at most budget / 8 suffixes, and a key with
+ *         more suffixes than that is split by the next two symbols, down to
+ *         SUFFIX_MAX_DEPTH symbols (a prefix that long repeating more often is
+ *         sorted in one pass over the budget, with a warning)
+ *       - each pass gathers its suffixes in parallel in one scan of the text,
+ *         partitions them by key in place, sorts the buckets in parallel by
+ *         comparing suffixes after their shared prefix, and appends the SA
+ *         and LCP entries to the file in order, so both are written
+ *         sequentially and never held in memory
+ *       - the output is byte-identical to SA-IS. Each pass scans the text
+ *         once and comparisons cost the length of the common prefixes, so
+ *         text with long repeats occurring many times is slow to build this
+ *         way, SA-IS stays linear
+ * 10) Optionally (--phrases) return the most frequent maximal repeated phrases
+ *    of any length (at least 2 words, at least --min-count occurrences):
+ *    i) the normalized corpus is mapped to int32 word ids and the suffix array
+ *       and PLCP of 9) are built over the ids
+ *   ii) every phrase occurring more than once is the common prefix of an LCP
+ *       interval [lb, rb] (lcp = its length in words, rb - lb + 1 = its count),
+ *       intervals are enumerated bottom-up with a stack in one scan and are
+ *       right-maximal by construction
+ *  iii) a phrase is left-maximal if the words before its occurrences differ,
+ *       with changes[i] = number of ranks j <= i whose preceding word differs
+ *       from rank j - 1's (or is the start of the corpus) this is
+ *       changes[rb] > changes[lb] or a change at lb itself, in O(1)
+ *   iv) the best k by count, then length, are kept in a min-heap of k entries
  * 
+ * Build:
+ * gcc -O2 -fopenmp most_freq_words.c -o most_freq_words -lm
+ *
  * Reference:
  * 1) https://storage.googleapis.com/download.tensorflow.org/data/shakespeare.txt
  * 2) http://www.cse.yorku.ca/~oz/hash.html (hash function)
+ * 3) A. Kirsch, M. Mitzenmacher, Less Hashing, Same Performance: Building a
+ *    Better Bloom Filter (double hashing)
+ * 4) G. Nong, S. Zhang, W. H. Chan, Two Efficient Algorithms for Linear Time
+ *    Suffix Array Construction (SA-IS)
+ * 5) J. Karkkainen, G. Manzini, S. J. Puglisi, Permuted Longest-Common-Prefix
+ *    Array (Phi algorithm)
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define HASH_TABLE_SIZE 10000
+#define WORD_BUFFER_SIZE 150
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PARALLEL_MIN 65536 // below this many keys threads cost more than they save
+#define HEAPS_CHECKPOINTS_PER_DOUBLING 4
+#define HEAPS_MAX_CHECKPOINTS (64 * HEAPS_CHECKPOINTS_PER_DOUBLING + 1)
+#define ZIPF_MIN_COUNT 2
+#define CASE_VARIANTS 3
+#define CASE_MASK_BITS 64
+#define READ_BUFFER_SIZE 65536
+#define LOCATION_SAMPLES 4
+#define BLOOM_BYTES_PER_WORD 8  // file bytes per distinct word assumed when sizing the filter
+#define BLOOM_BITS_PER_WORD 10
+#define BLOOM_HASHES 7          // ~1% false positives at BLOOM_BITS_PER_WORD
+#define BLOOM_MIN_BITS 1024
+#define HLL_PRECISION 12        // 2^12 one byte registers, ~1.6% standard error
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define SUFFIX_INDEX_MAGIC "MFWSAIX2"
+#define SUFFIX_KEYS (257 * 257)   // keys of two symbols, 0 = end of text
+#define SUFFIX_MAX_DEPTH 64       // longest prefix a bucket is split by
+#define SUFFIX_MIN_PASS 1024      // least suffixes per bucketed pass
+#define SUFFIX_GATHER_BATCH 4096  // positions a thread collects before reserving room
+#define PHRASE_MIN_WORDS 2
+
+/* Counting modes */
+#define COUNT_MODE_EXACT 0
+#define COUNT_MODE_APPROXIMATE 1 // Space-Saving, used when over memory budget
+
+/*******************************************************************************
+ * CORPUS STATISTICS
+ *******************************************************************************/
+/* Statistics gathered during the counting pass */
+typedef struct FreqReport {
+    uint64_t num_tokens;   // number of words read
+    uint64_t num_distinct; // number of distinct words
+    int distinct_estimated; // num_distinct and checkpoints are sketch estimates
+
+    /* Heaps' law: checkpoint_distinct[i] distinct words after checkpoint_tokens[i]
+       tokens, last checkpoint is always the end of the corpus */
+    int num_checkpoints;
+    uint64_t checkpoint_tokens[HEAPS_MAX_CHECKPOINTS];
+    uint64_t checkpoint_distinct[HEAPS_MAX_CHECKPOINTS];
+    uint64_t next_checkpoint; // token count of the next checkpoint
+    double heaps_k;
+    double heaps_beta;
+
+    /* Zipf's law exponent */
+    double zipf_exponent;
+
+    /* Counting mode that produced the result and, for approximate counting, the
+       largest possible overestimate of a returned count */
+    int mode;
+    int max_error;
+    size_t memory_used;     // bytes of the counting structures at end of pass
+    size_t memory_overhead; // fixed part of memory_used, the table and distinct word sketch
+
+    /* Sampled locations of the returned words, LOCATION_SAMPLES per word in
+       order of offset, unused slots have line 0. Freed by the caller */
+    struct WordLocation *locations;
+
+    /* Counts of the returned words. Freed by the caller */
+    int *counts;
+
+    /* Two-stage counting: bytes of the first-sighting filter and estimated
+       chance that a first sighting was counted twice */
+    size_t filter_bytes;
+    double false_positive_rate;
+} FreqReport;
+
+/* Repeated phrase and its number of occurrences */
+typedef struct Phrase {
+    char *text;     // words joined by single spaces
+    int64_t count;
+    int64_t length; // words
+} Phrase;
+
+/* Options of a counting run */
+typedef struct FreqOptions {
+    size_t memory_budget; // bytes, 0 = unlimited
+    int compute_stats;    // fill Heaps' and Zipf's law fields of the report
+    int original_case;    // return dominant original form instead of lowercase
+    int sample_locations; // fill locations of the report
+    int two_stage;        // add words to the table on their second sighting
+} FreqOptions;
+
+/*******************************************************************************
+ * HASH TABLE DEFINITION
+ *******************************************************************************/
+/* Tokenizer rule: c continues or starts a word with pos characters so far */
+int is_word_char(int c, int pos){
+    return isalpha(c) || (c == '\'' && pos > 0);
+}
+
+/* Location of a word in the source file */
+typedef struct WordLocation {
+    uint64_t offset; // byte offset of first character
+    uint32_t line;   // 1 based line number
+} WordLocation;
+
+/* Most common original casings, bit i of mask set = character i uppercase */
+typedef struct CaseVariants {
+    uint64_t mask[CASE_VARIANTS];
+    int count[CASE_VARIANTS];
+} CaseVariants;
+
+/* Reservoir sample of occurrence locations */
+typedef struct LocationSamples {
+    uint64_t seen; // occurrences offered to the reservoir
+    WordLocation slot[LOCATION_SAMPLES];
+} LocationSamples;
+
+/* Hash table is an array of linked lists */
+/* Linked list to deal with collisions of same hash key*/
+typedef struct WordFreqNode {
+    char* word;
+    int count;
+    struct WordFreqNode *next;
+    int error;          // approximate mode: count inherited from evicted word
+    size_t heap_index;  // approximate mode: position in min-heap
+    CaseVariants *cases;    // --original-case, NULL otherwise
+    LocationSamples *samples; // --locations, NULL otherwise
+} WordFreqNode;
+
+/* Bloom filter of words seen once */
+typedef struct BloomFilter {
+    uint64_t *bits;
+    uint64_t mask; // number of bits - 1, a power of two
+} BloomFilter;
+
+/* Hash table with memory accounting */
+typedef struct WordFreqTable {
+    WordFreqNode *buckets[HASH_TABLE_SIZE];
+    size_t num_nodes;
+    size_t memory_used;   // bytes of buckets, nodes, word strings, heap slots, filter and sketch
+    size_t memory_budget; // 0 = unlimited
+    int mode;
+    WordFreqNode **heap;  // approximate mode: min-heap of nodes by count
+    BloomFilter *first_sightings; // two-stage mode, NULL otherwise
+    uint8_t *distinct_sketch; // HyperLogLog registers when the table cannot count distinct words, NULL otherwise
+    int track_case;       // nodes carry CaseVariants
+    int track_locations;  // nodes carry location samples
+} WordFreqTable;
+
+/* Bytes of a node and its optional arrays, allocated together */
+size_t node_size(const WordFreqTable *table){
+    return sizeof(WordFreqNode) + (table->track_case ? sizeof(CaseVariants) : 0)
+           + (table->track_locations ? sizeof(LocationSamples) : 0);
+}
+
+/* Bytes accounted for a node holding word, a heap slot is reserved for every
+   node so switching to approximate mode never exceeds the budget */
+size_t node_memory(const WordFreqTable *table, const char *word){
+    return node_size(table) + strlen(word) + 1 + sizeof(WordFreqNode *);
+}
+
+/* Smallest budget that holds the table, the distinct word sketch when
+   statistics are computed and a node of a one letter word */
+size_t min_memory_budget(const FreqOptions *options){
+    WordFreqTable table = {0};
+    table.track_case = options->original_case;
+    table.track_locations = options->sample_locations;
+    return sizeof(WordFreqTable) + (options->compute_stats ? HLL_REGISTERS : 0) + node_memory(&table, "a");
+}
+
+/* Use DJB2 Hash Function */
+unsigned int djb2_hash(const char* word){
+    unsigned int hash = 5381;
+    int c;
+    while (c = *word++){
+        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+    }
+    return hash % HASH_TABLE_SIZE;
+}
+
+/* Clear the optional arrays of node */
+void reset_node_extras(WordFreqNode *node){
+    if (node->cases){
+        memset(node->cases, 0, sizeof(CaseVariants));
+    }
+    if (node->samples){
+        memset(node->samples, 0, sizeof(LocationSamples));
+    }
+}
+
+/* Create a new WordFreqNode, the optional arrays the table tracks follow the
+   node in the same allocation */
+WordFreqNode* create_WordFreqNode(const WordFreqTable *table, const char *word){
+    WordFreqNode *new_node = (WordFreqNode*)malloc(node_size(table));
+    if (!new_node) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    new_node->word = strdup(word);
+    new_node->count = 1;
+    new_node->next = NULL;
+    new_node->error = 0;
+    new_node->heap_index = 0;
+    char *extra = (char *)(new_node + 1);
+    new_node->cases = NULL;
+    new_node->samples = NULL;
+    if (table->track_case){
+        new_node->cases = (CaseVariants *)extra;
+        extra += sizeof(CaseVariants);
+    }
+    if (table->track_locations){
+        new_node->samples = (LocationSamples *)extra;
+    }
+    reset_node_extras(new_node);
+    return new_node;
+}
+
+/* Count one occurrence of the original casing given by mask
+   Unused slots have count 0 so they are the first to be replaced */
+void add_case_variant(CaseVariants *cases, uint64_t mask){
+    int slot = 0;
+    for (int i = 0; i < CASE_VARIANTS; i++){
+        if (cases->mask[i] == mask){
+            slot = i;
+            break;
+        }
+        if (cases->count[i] < cases->count[slot]){
+            slot = i;
+        }
+    }
+    cases->mask[slot] = mask;
+    cases->count[slot]++;
+}
+
+/* Most common original form of node's word, as a new string */
+char *dominant_form(const WordFreqNode *node){
+    const CaseVariants *cases = node->cases;
+    int best = 0;
+    for (int i = 1; i < CASE_VARIANTS; i++){
+        if (cases->count[i] > cases->count[best]){
+            best = i;
+        }
+    }
+    char *form = strdup(node->word);
+    if (!form){
+        return NULL;
+    }
+    for (int i = 0; form[i] && i < CASE_MASK_BITS; i++){
+        if ((cases->mask[best] >> i) & 1){
+            form[i] = toupper((unsigned char)form[i]);
+        }
+    }
+    return form;
+}
+
+/*******************************************************************************
+ * FIRST SIGHTING FILTER (TWO-STAGE COUNTING)
+ *******************************************************************************/
+uint64_t fnv1a_64(const char *word, size_t len){
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)word[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Filter for a file of file_size bytes, no larger than max_bytes (0 = no
+   limit), see Solution 8). NULL if max_bytes cannot hold BLOOM_MIN_BITS */
+BloomFilter *create_bloom_filter(uint64_t file_size, size_t max_bytes){
+    if (max_bytes > 0 && max_bytes < sizeof(BloomFilter) + BLOOM_MIN_BITS / 8){
+        return NULL;
+    }
+    uint64_t wanted = file_size / BLOOM_BYTES_PER_WORD * BLOOM_BITS_PER_WORD;
+    uint64_t num_bits = BLOOM_MIN_BITS;
+    while (num_bits < wanted && (max_bytes == 0 || sizeof(BloomFilter) + num_bits / 4 <= max_bytes)){
+        num_bits *= 2;
+    }
+    BloomFilter *filter = malloc(sizeof(BloomFilter));
+    if (!filter){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    filter->bits = calloc(num_bits / 64, sizeof(uint64_t));
+    if (!filter->bits){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    filter->mask = num_bits - 1;
+    return filter;
+}
+
+size_t bloom_filter_memory(const BloomFilter *filter){
+    return sizeof(BloomFilter) + (filter->mask + 1) / 8;
+}
+
+/* Add word, returns 1 if all its bits were already set (seen before or a
+   false positive) */
+int bloom_check_and_add(BloomFilter *filter, const char *word){
+    uint64_t hash = fnv1a_64(word, strlen(word));
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | 1; // odd step visits distinct bits
+    int seen = 1;
+    for (int i = 0; i < BLOOM_HASHES; i++){
+        uint64_t bit = (h1 + (uint64_t)i * h2) & filter->mask;
+        uint64_t word_bit = (uint64_t)1 << (bit & 63);
+        seen &= (filter->bits[bit >> 6] & word_bit) != 0;
+        filter->bits[bit >> 6] |= word_bit;
+    }
+    return seen;
+}
+
+/* Chance that a word not added yet is reported as seen, (bits set)^k */
+double bloom_false_positive_rate(const BloomFilter *filter){
+    uint64_t num_set = 0;
+    for (uint64_t i = 0; i <= filter->mask / 64; i++){
+        num_set += __builtin_popcountll(filter->bits[i]);
+    }
+    return pow((double)num_set / (filter->mask + 1), BLOOM_HASHES);
+}
+
+/*******************************************************************************
+ * DISTINCT WORD SKETCH (HYPERLOGLOG)
+ *******************************************************************************/
+/* Add word to the sketch, register = top HLL_PRECISION bits of a mixed FNV-1a
+   hash, value = position of the first set bit of the rest */
+void hll_add(uint8_t *registers, const char *word){
+    uint64_t hash = fnv1a_64(word, strlen(word));
+    hash ^= hash >> 33; // murmur3 finalizer, FNV-1a alone mixes the high bits poorly
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    uint64_t rest = (hash << HLL_PRECISION) | ((uint64_t)1 << (HLL_PRECISION - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    uint8_t *reg = &registers[hash >> (64 - HLL_PRECISION)];
+    if (rank > *reg){
+        *reg = rank;
+    }
+}
+
+/* Estimated number of distinct words added, linear counting while registers
+   are still empty */
+uint64_t hll_estimate(const uint8_t *registers){
+    double m = HLL_REGISTERS;
+    double sum = 0.0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++){
+        sum += ldexp(1.0, -registers[i]);
+        zeros += (registers[i] == 0);
+    }
+    double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0){
+        estimate = m * log(m / zeros);
+    }
+    return (uint64_t)llround(estimate);
+}
+
+/*******************************************************************************
+ * APPROXIMATE COUNTING (SPACE-SAVING)
+ *******************************************************************************/
+void heap_swap(WordFreqNode **heap, size_t i, size_t j){
+    WordFreqNode *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->heap_index = i;
+    heap[j]->heap_index = j;
+}
+
+/* Restore min-heap order below i after heap[i]'s count increased */
+void heap_sift_down(WordFreqNode **heap, size_t size, size_t i){
+    while (1){
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && heap[left]->count < heap[smallest]->count){
+            smallest = left;
+        }
+        if (right < size && heap[right]->count < heap[smallest]->count){
+            smallest = right;
+        }
+        if (smallest == i){
+            return;
+        }
+        heap_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+/* Stop allocating nodes, build a min-heap over the existing ones */
+void switch_to_approximate(WordFreqTable *table){
+    table->heap = malloc(table->num_nodes * sizeof(WordFreqNode *));
+    if (!table->heap){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t i = 0;
+    for (int b = 0; b < HASH_TABLE_SIZE; b++){
+        for (WordFreqNode *node = table->buckets[b]; node; node = node->next){
+            node->heap_index = i;
+            table->heap[i++] = node;
+        }
+    }
+    for (size_t k = table->num_nodes / 2; k-- > 0; ){
+        heap_sift_down(table->heap, table->num_nodes, k);
+    }
+    table->mode = COUNT_MODE_APPROXIMATE;
+}
+
+/* Unlink node from its bucket */
+void unlink_node(WordFreqTable *table, WordFreqNode *node){
+    WordFreqNode **link = &table->buckets[djb2_hash(node->word)];
+    while (*link != node){
+        link = &(*link)->next;
+    }
+    *link = node->next;
+}
+
+/* Free the least frequent node, its heap slot stays allocated and accounted */
+void evict_min_node(WordFreqTable *table){
+    WordFreqNode *node = table->heap[0];
+    unlink_node(table, node);
+    table->memory_used -= node_memory(table, node->word) - sizeof(WordFreqNode *);
+    table->num_nodes--;
+    table->heap[0] = table->heap[table->num_nodes];
+    table->heap[0]->heap_index = 0;
+    heap_sift_down(table->heap, table->num_nodes, 0);
+    free(node->word);
+    free(node);
+}
+
+/* Replace the least frequent node with word, returns the reused node
+   Further least frequent nodes are evicted first while the longer word would
+   exceed the budget, NULL (word not kept) if it does not fit even as the only
+   node. The evicted counts are at most the inherited one, so the error bound
+   is unchanged */
+WordFreqNode *replace_min_node(WordFreqTable *table, const char *word, unsigned int search_key){
+    size_t new_memory = node_memory(table, word);
+    while (table->memory_used - node_memory(table, table->heap[0]->word) + new_memory > table->memory_budget){
+        if (table->num_nodes == 1){
+            return NULL;
+        }
+        evict_min_node(table);
+    }
+
+    WordFreqNode *node = table->heap[0];
+    unlink_node(table, node);
+
+    table->memory_used -= node_memory(table, node->word);
+    free(node->word);
+    node->word = strdup(word);
+    if (!node->word){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    table->memory_used += new_memory;
+
+    node->error = node->count;
+    node->count++;
+    reset_node_extras(node);
+    node->next = table->buckets[search_key];
+    table->buckets[search_key] = node;
+    heap_sift_down(table->heap, table->num_nodes, 0);
+    return node;
+}
+
+/* Insert word or update frequency count, returns its node
+   is_new is set to 1 if the word was not in the table. In two-stage mode
+   the first sighting of a word only goes to the filter and NULL is returned */
+WordFreqNode *add_word(WordFreqTable *table, const char *word, int *is_new){
+    unsigned int search_key = djb2_hash(word);
+    WordFreqNode *node = table->buckets[search_key];
+
+    /* Check if word is already in hash table */
+    while (node != NULL){
+        if (strcmp(node->word, word) == 0){
+            node->count++;
+            if (table->mode == COUNT_MODE_APPROXIMATE){
+                heap_sift_down(table->heap, table->num_nodes, node->heap_index);
+            }
+            *is_new = 0;
+            return node;
+        }
+        node = node->next;
+    }
+
+    /* Second sighting in two-stage mode, the first was only recorded in the
+       filter and is counted when the node is created below */
+    int sightings = 1;
+    if (table->first_sightings){
+        if (!bloom_check_and_add(table->first_sightings, word)){
+            *is_new = 1;
+            return NULL;
+        }
+        sightings = 2;
+    }
+
+    /* Switch to approximate counting if a new node would exceed the budget */
+    size_t new_memory = node_memory(table, word);
+    if (table->mode == COUNT_MODE_EXACT && table->memory_budget > 0 && table->num_nodes > 0
+        && table->memory_used + new_memory > table->memory_budget){
+        switch_to_approximate(table);
+    }
+    /* in two-stage mode the word was already counted as distinct on its
+       first sighting, and a replaced node's inherited count + 1 (at least 2)
+       already covers that sighting, so nothing is added for it */
+    *is_new = (table->first_sightings == NULL);
+    if (table->mode == COUNT_MODE_APPROXIMATE){
+        return replace_min_node(table, word, search_key);
+    }
+
+    /* Else if not found, add to hash table at top of list */
+    WordFreqNode *new_node = create_WordFreqNode(table, word);
+    new_node->count = sightings;
+    new_node->next = table->buckets[search_key];
+    table->buckets[search_key] = new_node;
+    table->num_nodes++;
+    table->memory_used += new_memory;
+    return new_node;
+}
+
+/* Record a distinct word count checkpoint */
+void add_checkpoint(FreqReport *report){
+    int i = report->num_checkpoints;
+    if (report->num_tokens == 0 || (i > 0 && report->checkpoint_tokens[i - 1] == report->num_tokens)){
+        return; // empty corpus or already recorded
+    }
+    if (i < HEAPS_MAX_CHECKPOINTS){
+        report->checkpoint_tokens[i] = report->num_tokens;
+        report->checkpoint_distinct[i] = report->num_distinct;
+        report->num_checkpoints++;
+    }
+
+    /* next geometric checkpoint, 2^(k / HEAPS_CHECKPOINTS_PER_DOUBLING) tokens
+       rounded, skipping values that round to the same token count */
+    for (int k = report->num_checkpoints; ; k++){
+        uint64_t next = (uint64_t)llround(pow(2.0, (double)k / HEAPS_CHECKPOINTS_PER_DOUBLING));
+        if (next > report->num_tokens){
+            report->next_checkpoint = next;
+            break;
+        }
+    }
+}
+
+/* Take the distinct word count from the sketch once the table cannot give
+   it: evicted words come back as new in approximate mode, and a filter false
+   positive hides a first sighting in two-stage mode */
+void update_distinct(const WordFreqTable *table, FreqReport *report){
+    if (table->distinct_sketch && (table->mode == COUNT_MODE_APPROXIMATE || table->first_sightings)){
+        report->num_distinct = hll_estimate(table->distinct_sketch);
+        report->distinct_estimated = 1;
+    }
+}
+
+/* Add word to hash table and update corpus statistics, returns its node
+   (NULL for the first sighting in two-stage mode) */
+WordFreqNode *count_word(WordFreqTable *table, const char *word, uint64_t case_mask, FreqReport *report){
+    int is_new;
+    WordFreqNode *node = add_word(table, word, &is_new);
+    if (node && node->cases){
+        add_case_variant(node->cases, case_mask);
+    }
+    report->num_tokens++;
+    report->num_distinct += is_new;
+    if (table->distinct_sketch){
+        hll_add(table->distinct_sketch, word);
+    }
+    if (report->num_tokens == report->next_checkpoint){
+        update_distinct(table, report);
+        add_checkpoint(report);
+    }
+    return node;
+}
+
+/*******************************************************************************
+ * LOCATION SAMPLING
+ *******************************************************************************/
+/* Location sampling state of the counting pass */
+typedef struct LocationSampler {
+    uint64_t rng_state;  // xorshift64* state
+    const char *buffer;  // read buffer being tokenized
+    size_t scan_pos;     // newlines of buffer counted up to here
+    uint32_t line;       // line number at buffer[scan_pos]
+} LocationSampler;
+
+uint64_t xorshift64_star(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Number of '\n' in buf[0, len) */
+size_t count_newlines(const char *buf, size_t len){
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+#endif
+    for (; i < len; i++){
+        count += (buf[i] == '\n');
+    }
+    return count;
+}
+
+/* Advance the line count to buffer position pos */
+void advance_lines(LocationSampler *sampler, size_t pos){
+    sampler->line += count_newlines(sampler->buffer + sampler->scan_pos, pos - sampler->scan_pos);
+    sampler->scan_pos = pos;
+}
+
+/* Reservoir sample the latest occurrence of node, found at file offset and at
+   buffer position pos (words do not span lines so any position of the word
+   gives its line) */
+void sample_location(WordFreqNode *node, LocationSampler *sampler, uint64_t offset, size_t pos){
+    LocationSamples *samples = node->samples;
+    uint64_t k = ++samples->seen;
+    uint64_t slot = k - 1;
+    if (k > LOCATION_SAMPLES){
+        slot = xorshift64_star(&sampler->rng_state) % k;
+        if (slot >= LOCATION_SAMPLES){
+            return;
+        }
+    }
+    advance_lines(sampler, pos);
+    samples->slot[slot].offset = offset;
+    samples->slot[slot].line = sampler->line;
+}
+
+int compare_by_offset(const void *a, const void *b){
+    const WordLocation *loc_a = a;
+    const WordLocation *loc_b = b;
+    if (loc_a->line == 0 || loc_b->line == 0){
+        return (loc_a->line == 0) - (loc_b->line == 0); // unused slots last
+    }
+    return (loc_a->offset > loc_b->offset) - (loc_a->offset < loc_b->offset);
+}
+
+/* Least squares fit of y = a + b * x, returns slope b and intercept a */
+void fit_line(const double *x, const double *y, size_t len, double *a, double *b){
+    double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0;
+    for (size_t i = 0; i < len; i++){
+        sum_x += x[i];
+        sum_y += y[i];
+        sum_xx += x[i] * x[i];
+        sum_xy += x[i] * y[i];
+    }
+    double denom = len * sum_xx - sum_x * sum_x;
+    *b = (denom != 0.0) ? (len * sum_xy - sum_x * sum_y) / denom : 0.0;
+    *a = (len > 0) ? (sum_y - *b * sum_x) / len : 0.0;
+}
+
+/* Fit Heaps' law to the checkpoints */
+void fit_heaps_law(FreqReport *report){
+    double x[HEAPS_MAX_CHECKPOINTS];
+    double y[HEAPS_MAX_CHECKPOINTS];
+    for (int i = 0; i < report->num_checkpoints; i++){
+        x[i] = log((double)report->checkpoint_tokens[i]);
+        y[i] = log((double)report->checkpoint_distinct[i]);
+    }
+    double log_k;
+    fit_line(x, y, report->num_checkpoints, &log_k, &report->heaps_beta);
+    report->heaps_k = exp(log_k);
+}
+
+/* Fit Zipf's exponent to nodes sorted by count (high to low) */
+void fit_zipf_law(FreqReport *report, WordFreqNode **sorted_nodes, size_t count){
+    size_t len = 0;
+    while (len < count && sorted_nodes[len]->count >= ZIPF_MIN_COUNT){
+        len++;
+    }
+    double *x = malloc((len + 1) * sizeof(double));
+    double *y = malloc((len + 1) * sizeof(double));
+    if (!x || !y){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < len; i++){
+        x[i] = log((double)(i + 1));
+        y[i] = log((double)sorted_nodes[i]->count);
+    }
+    double intercept, slope;
+    fit_line(x, y, len, &intercept, &slope);
+    report->zipf_exponent = -slope;
+    free(x);
+    free(y);
+}
+
+/* Comparison function for quick sort algorithm */
+int compare_by_frequency(const void *a, const void *b){
+    WordFreqNode *node_a = *(WordFreqNode **)a;
+    WordFreqNode *node_b = *(WordFreqNode **)b;
+    return node_b->count - node_a->count; // sort high to low
+}
+
+/*******************************************************************************
+ * RADIX SORT (FULL VOCABULARY RANKING)
+ *******************************************************************************/
+/* LSD radix sort of 64-bit keys, RADIX_BITS per pass
+   Keys are split into one contiguous chunk per thread, each chunk builds its own
+   histogram and scatters into its own slice of every bucket, so the sort is
+   stable and needs no atomics. Passes where every key has the same digit are
+   skipped (e.g. the high bytes of the inverted count) */
+void radix_sort_u64(uint64_t *keys, size_t len){
+    uint64_t *tmp = malloc(len * sizeof(uint64_t));
+    int num_chunks = 1;
+#ifdef _OPENMP
+    if (len >= RADIX_PARALLEL_MIN){
+        num_chunks = omp_get_max_threads();
+    }
+#endif
+    size_t *histogram = malloc((size_t)num_chunks * RADIX_BUCKETS * sizeof(size_t));
+    if (!tmp || !histogram){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t *src = keys;
+    uint64_t *dst = tmp;
+    for (int shift = 0; shift < 64; shift += RADIX_BITS){
+        memset(histogram, 0, (size_t)num_chunks * RADIX_BUCKETS * sizeof(size_t));
+
+        /* count digits of each chunk */
+        #pragma omp parallel for schedule(static) if (num_chunks > 1)
+        for (int t = 0; t < num_chunks; t++){
+            size_t *hist = histogram + (size_t)t * RADIX_BUCKETS;
+            size_t begin = len * t / num_chunks;
+            size_t end = len * (t + 1) / num_chunks;
+            for (size_t i = begin; i < end; i++){
+                hist[(src[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            }
+        }
+
+        /* exclusive prefix sum in (digit, chunk) order gives each chunk its
+           starting offset in every bucket */
+        size_t offset = 0;
+        int trivial_pass = 0;
+        for (int d = 0; d < RADIX_BUCKETS; d++){
+            size_t digit_total = 0;
+            for (int t = 0; t < num_chunks; t++){
+                size_t c = histogram[(size_t)t * RADIX_BUCKETS + d];
+                histogram[(size_t)t * RADIX_BUCKETS + d] = offset;
+                offset += c;
+                digit_total += c;
+            }
+            if (digit_total == len){
+                trivial_pass = 1;
+            }
+        }
+        if (trivial_pass){
+            continue; // all keys share this digit, order is unchanged
+        }
+
+        /* scatter */
+        #pragma omp parallel for schedule(static) if (num_chunks > 1)
+        for (int t = 0; t < num_chunks; t++){
+            size_t *hist = histogram + (size_t)t * RADIX_BUCKETS;
+            size_t begin = len * t / num_chunks;
+            size_t end = len * (t + 1) / num_chunks;
+            for (size_t i = begin; i < end; i++){
+                dst[hist[(src[i] >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+            }
+        }
+
+        uint64_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != keys){
+        memcpy(keys, src, len * sizeof(uint64_t));
+    }
+    free(histogram);
+    free(tmp);
+}
+
+/* Sort nodes by count (high to low) using radix sort on packed keys
+   key = (UINT32_MAX - count) << 32 | index, so ascending key order is
+   descending count, ties broken by position in the array */
+void radix_sort_by_frequency(WordFreqNode **nodes, size_t len){
+    uint64_t *keys = malloc(len * sizeof(uint64_t));
+    WordFreqNode **sorted = malloc(len * sizeof(WordFreqNode *));
+    if (!keys || !sorted){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < len; i++){
+        uint64_t inverted_count = UINT32_MAX - (uint32_t)nodes[i]->count;
+        keys[i] = (inverted_count << 32) | (uint32_t)i;
+    }
+
+    radix_sort_u64(keys, len);
+
+    for (size_t i = 0; i < len; i++){
+        sorted[i] = nodes[(uint32_t)keys[i]];
+    }
+    memcpy(nodes, sorted, len * sizeof(WordFreqNode *));
+
+    free(sorted);
+    free(keys);
+}
+
+/*******************************************************************************
+ * SUFFIX ARRAY (SA-IS)
+ *******************************************************************************/
+/* Symbol i of a suffix array construction over length symbols (sentinel
+   included). Bytes and int32 token ids have a virtual sentinel 0 appended
+   and every symbol shifted up by one, the reduced strings of the recursion
+   are stored in the suffix array itself and end in their own sentinel */
+static inline int64_t byte_symbol(const void *data, int64_t length, int64_t i){
+    return (i == length - 1) ? 0 : (int64_t)((const unsigned char *)data)[i] + 1;
+}
+
+static inline int64_t token_symbol(const void *data, int64_t length, int64_t i){
+    return (i == length - 1) ? 0 : (int64_t)((const int32_t *)data)[i] + 1;
+}
+
+static inline int64_t reduced32_symbol(const void *data, int64_t length, int64_t i){
+    (void)length;
+    return ((const int32_t *)data)[i];
+}
+
+static inline int64_t reduced64_symbol(const void *data, int64_t length, int64_t i){
+    (void)length;
+    return ((const int64_t *)data)[i];
+}
+
+/* S-type bit of every position, 1 = suffix i is smaller than suffix i + 1 */
+int is_s_type(const uint8_t *types, int64_t i){
+    return (types[i >> 3] >> (i & 7)) & 1;
+}
+
+int is_lms(const uint8_t *types, int64_t i){
+    return i > 0 && is_s_type(types, i) && !is_s_type(types, i - 1);
+}
+
+/* SA-IS over the symbols read by SYMBOL with entries of type INDEX, defines
+   get_buckets_NAME(), induce_sort_NAME() and sais_NAME(). REDUCED is the
+   sais_ function of the recursion over INDEX symbols. One instance per symbol
+   kind and entry width, so the symbol read is inlined into every loop
+
+   get_buckets: start (or end, exclusive) of the bucket of every symbol
+   induce_sort: induce L-type suffixes left to right, then S-type right to left
+   sais: suffix array of the n symbols of text (sentinel included,
+         sa[0] = n - 1), symbols in [0, alphabet) */
+#define DEFINE_SAIS(NAME, INDEX, SYMBOL, REDUCED) \
+static void get_buckets_##NAME(const void *text, int64_t n, INDEX *buckets, int64_t alphabet, int end){ \
+    memset(buckets, 0, alphabet * sizeof(INDEX)); \
+    for (int64_t i = 0; i < n; i++){ \
+        buckets[SYMBOL(text, n, i)]++; \
+    } \
+    INDEX sum = 0; \
+    for (int64_t c = 0; c < alphabet; c++){ \
+        sum += buckets[c]; \
+        buckets[c] = end ? sum : sum - buckets[c]; \
+    } \
+} \
+\
+static void induce_sort_##NAME(const void *text, int64_t n, const uint8_t *types, INDEX *sa, INDEX *buckets, \
+                               int64_t alphabet){ \
+    get_buckets_##NAME(text, n, buckets, alphabet, 0); \
+    for (int64_t i = 0; i < n; i++){ \
+        INDEX j = sa[i] - 1; \
+        if (sa[i] > 0 && !is_s_type(types, j)){ \
+            sa[buckets[SYMBOL(text, n, j)]++] = j; \
+        } \
+    } \
+    get_buckets_##NAME(text, n, buckets, alphabet, 1); \
+    for (int64_t i = n - 1; i >= 0; i--){ \
+        INDEX j = sa[i] - 1; \
+        if (sa[i] > 0 && is_s_type(types, j)){ \
+            sa[--buckets[SYMBOL(text, n, j)]] = j; \
+        } \
+    } \
+} \
+\
+static void sais_##NAME(const void *text, int64_t n, INDEX *sa, int64_t alphabet){ \
+    if (n == 1){ \
+        sa[0] = 0; \
+        return; \
+    } \
+    uint8_t *types = calloc((size_t)n / 8 + 1, 1); \
+    INDEX *buckets = malloc(alphabet * sizeof(INDEX)); \
+    if (!types || !buckets){ \
+        perror("Failed to allocate memory"); \
+        exit(EXIT_FAILURE); \
+    } \
+    types[(n - 1) >> 3] |= 1 << ((n - 1) & 7); /* sentinel is S-type */ \
+    for (int64_t i = n - 2; i >= 0; i--){ \
+        int64_t c = SYMBOL(text, n, i), next = SYMBOL(text, n, i + 1); \
+        if (c < next || (c == next && is_s_type(types, i + 1))){ \
+            types[i >> 3] |= 1 << (i & 7); \
+        } \
+    } \
+\
+    /* stage 1: sort the LMS substrings by induced sorting */ \
+    get_buckets_##NAME(text, n, buckets, alphabet, 1); \
+    for (int64_t i = 0; i < n; i++){ \
+        sa[i] = -1; \
+    } \
+    for (int64_t i = 1; i < n; i++){ \
+        if (is_lms(types, i)){ \
+            sa[--buckets[SYMBOL(text, n, i)]] = i; \
+        } \
+    } \
+    induce_sort_##NAME(text, n, types, sa, buckets, alphabet); \
+\
+    /* name the sorted LMS substrings, equal substrings get the same name */ \
+    int64_t num_lms = 0; \
+    for (int64_t i = 0; i < n; i++){ \
+        if (is_lms(types, sa[i])){ \
+            sa[num_lms++] = sa[i]; \
+        } \
+    } \
+    for (int64_t i = num_lms; i < n; i++){ \
+        sa[i] = -1; \
+    } \
+    int64_t name = 0, prev = -1; \
+    for (int64_t i = 0; i < num_lms; i++){ \
+        int64_t pos = sa[i]; \
+        int diff = 0; \
+        for (int64_t d = 0; d < n; d++){ \
+            if (prev == -1 || SYMBOL(text, n, pos + d) != SYMBOL(text, n, prev + d) \
+                || is_s_type(types, pos + d) != is_s_type(types, prev + d)){ \
+                diff = 1; \
+                break; \
+            } \
+            if (d > 0 && (is_lms(types, pos + d) || is_lms(types, prev + d))){ \
+                break; \
+            } \
+        } \
+        if (diff){ \
+            name++; \
+            prev = pos; \
+        } \
+        sa[num_lms + pos / 2] = (INDEX)(name - 1); /* LMS positions are at least 2 apart */ \
+    } \
+    for (int64_t i = n - 1, j = n - 1; i >= num_lms; i--){ \
+        if (sa[i] >= 0){ \
+            sa[j--] = sa[i]; \
+        } \
+    } \
+\
+    /* stage 2: sort the reduced string, recursively if names repeat */ \
+    INDEX *reduced = sa + n - num_lms; \
+    if (name < num_lms){ \
+        REDUCED(reduced, num_lms, sa, name); \
+    } \
+    else { \
+        for (int64_t i = 0; i < num_lms; i++){ \
+            sa[reduced[i]] = (INDEX)i; \
+        } \
+    } \
+\
+    /* stage 3: place the sorted LMS suffixes and induce the rest */ \
+    for (int64_t i = 1, j = 0; i < n; i++){ \
+        if (is_lms(types, i)){ \
+            reduced[j++] = (INDEX)i; \
+        } \
+    } \
+    for (int64_t i = 0; i < num_lms; i++){ \
+        sa[i] = reduced[sa[i]]; \
+    } \
+    for (int64_t i = num_lms; i < n; i++){ \
+        sa[i] = -1; \
+    } \
+    get_buckets_##NAME(text, n, buckets, alphabet, 1); \
+    for (int64_t i = num_lms - 1; i >= 0; i--){ \
+        INDEX j = sa[i]; \
+        sa[i] = -1; \
+        sa[--buckets[SYMBOL(text, n, j)]] = j; \
+    } \
+    induce_sort_##NAME(text, n, types, sa, buckets, alphabet); \
+\
+    free(buckets); \
+    free(types); \
+}
+
+/* Permuted LCP of the suffix array over the n symbols of text (sentinel not
+   included) read by SYMBOL: plcp[sa[i]] is the longest common prefix of
+   suffixes sa[i - 1] and sa[i], 0 for i = 0. Phi in place, num_chunks chunks
+   of text positions in parallel, each chunk restarting its LCP from 0 */
+#define DEFINE_PLCP(NAME, INDEX, SYMBOL) \
+static void build_plcp_##NAME(const void *text, int64_t n, const INDEX *sa, INDEX *plcp, int num_chunks){ \
+    _Pragma("omp parallel for schedule(static)") \
+    for (int64_t i = 0; i < n; i++){ \
+        plcp[sa[i]] = (i > 0) ? sa[i - 1] : -1; /* Phi */ \
+    } \
+    _Pragma("omp parallel for schedule(dynamic, 1)") \
+    for (int t = 0; t < num_chunks; t++){ \
+        int64_t begin = n * t / num_chunks; \
+        int64_t end = n * (t + 1) / num_chunks; \
+        int64_t h = 0; \
+        for (int64_t i = begin; i < end; i++){ \
+            int64_t prev = plcp[i]; \
+            if (prev < 0){ \
+                h = 0; \
+            } \
+            else { \
+                /* the sentinel ends every comparison */ \
+                while (SYMBOL(text, n + 1, i + h) == SYMBOL(text, n + 1, prev + h)){ \
+                    h++; \
+                } \
+            } \
+            plcp[i] = (INDEX)h; \
+            h = (h > 0) ? h - 1 : 0; \
+        } \
+    } \
+}
+
+DEFINE_SAIS(reduced32, int32_t, reduced32_symbol, sais_reduced32)
+DEFINE_SAIS(reduced64, int64_t, reduced64_symbol, sais_reduced64)
+DEFINE_SAIS(bytes32, int32_t, byte_symbol, sais_reduced32)
+DEFINE_SAIS(bytes64, int64_t, byte_symbol, sais_reduced64)
+DEFINE_SAIS(tokens32, int32_t, token_symbol, sais_reduced32)
+DEFINE_SAIS(tokens64, int64_t, token_symbol, sais_reduced64)
+DEFINE_PLCP(bytes32, int32_t, byte_symbol)
+DEFINE_PLCP(bytes64, int64_t, byte_symbol)
+DEFINE_PLCP(tokens32, int32_t, token_symbol)
+DEFINE_PLCP(tokens64, int64_t, token_symbol)
+
+/* Bytes per suffix array and PLCP entry for a text of n symbols */
+int suffix_entry_width(int64_t n){
+    return (n < INT32_MAX) ? 4 : 8;
+}
+
+int64_t suffix_entry(const void *entries, int width, int64_t i){
+    return (width == 4) ? ((const int32_t *)entries)[i] : ((const int64_t *)entries)[i];
+}
+
+/* Suffix array of the first n symbols of data (symbol_width 1 or 4, symbols
+   below alphabet), without the sentinel. sa holds n + 1 entries of
+   suffix_entry_width(n) bytes */
+void build_suffix_array(const void *data, int symbol_width, int64_t n, int64_t alphabet, void *sa){
+    int width = suffix_entry_width(n);
+    if (symbol_width == 1 && width == 4){
+        sais_bytes32(data, n + 1, sa, alphabet + 1);
+    }
+    else if (symbol_width == 1){
+        sais_bytes64(data, n + 1, sa, alphabet + 1);
+    }
+    else if (width == 4){
+        sais_tokens32(data, n + 1, sa, alphabet + 1);
+    }
+    else {
+        sais_tokens64(data, n + 1, sa, alphabet + 1);
+    }
+    memmove(sa, (char *)sa + width, n * width); // drop the sentinel suffix
+}
+
+/* PLCP of a suffix array built by build_suffix_array(), same entry width */
+void build_plcp(const void *data, int symbol_width, int64_t n, const void *sa, void *plcp){
+    int width = suffix_entry_width(n);
+    int num_chunks = 1;
+#ifdef _OPENMP
+    num_chunks = omp_get_max_threads();
+#endif
+    if (symbol_width == 1 && width == 4){
+        build_plcp_bytes32(data, n, sa, plcp, num_chunks);
+    }
+    else if (symbol_width == 1){
+        build_plcp_bytes64(data, n, sa, plcp, num_chunks);
+    }
+    else if (width == 4){
+        build_plcp_tokens32(data, n, sa, plcp, num_chunks);
+    }
+    else {
+        build_plcp_tokens64(data, n, sa, plcp, num_chunks);
+    }
+}
+
+/*******************************************************************************
+ * SUFFIX ARRAY INDEX
+ *******************************************************************************/
+/* Corpus normalized by the tokenizer, words in lowercase joined by single
+   spaces */
+typedef struct TextNormalizer {
+    char *text;
+    size_t length;
+    size_t capacity;
+    int pos; // characters of the current word
+    FILE *out;        // when set, full buffers are written here instead of grown
+    uint64_t written; // characters written to out
+    int write_error;
+} TextNormalizer;
+
+void normalizer_flush(TextNormalizer *normalizer){
+    if (fwrite(normalizer->text, 1, normalizer->length, normalizer->out) != normalizer->length){
+        normalizer->write_error = 1;
+    }
+    normalizer->written += normalizer->length;
+    normalizer->length = 0;
+}
+
+void normalizer_append(TextNormalizer *normalizer, char c){
+    if (normalizer->length == normalizer->capacity && normalizer->out && normalizer->capacity > 0){
+        normalizer_flush(normalizer);
+    }
+    else if (normalizer->length == normalizer->capacity){
+        normalizer->capacity = normalizer->capacity ? 2 * normalizer->capacity : READ_BUFFER_SIZE;
+        normalizer->text = realloc(normalizer->text, normalizer->capacity);
+        if (!normalizer->text){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    normalizer->text[normalizer->length++] = c;
+}
+
+/* Same rules as find_frequent_words_with_options(), including truncation */
+void normalize_block(TextNormalizer *normalizer, const char *buffer, size_t len){
+    for (size_t i = 0; i < len; i++){
+        int c = (unsigned char)buffer[i];
+        if (is_word_char(c, normalizer->pos)){
+            if (normalizer->pos < WORD_BUFFER_SIZE - 1){
+                if (normalizer->pos == 0 && normalizer->written + normalizer->length > 0){
+                    normalizer_append(normalizer, ' ');
+                }
+                normalizer_append(normalizer, tolower(c));
+                normalizer->pos++;
+            }
+        }
+        else {
+            normalizer->pos = 0;
+        }
+    }
+}
+
+/* Normalized text of the file at path, NUL terminated, NULL if it cannot be
+   read */
+char *normalize_file(const char *path, size_t *length){
+    FILE *file = fopen(path, "r");
+    if (!file){
+        perror("Failed to open file");
+        return NULL;
+    }
+    TextNormalizer normalizer = {0};
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file); // normalized text is never longer
+    rewind(file);
+    normalizer.capacity = (file_size > 0) ? (size_t)file_size + 1 : 1;
+    normalizer.text = malloc(normalizer.capacity);
+    char *read_buffer = malloc(READ_BUFFER_SIZE);
+    if (!normalizer.text || !read_buffer){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t len;
+    while ((len = fread(read_buffer, 1, READ_BUFFER_SIZE, file)) > 0){
+        normalize_block(&normalizer, read_buffer, len);
+    }
+    free(read_buffer);
+    fclose(file);
+    *length = normalizer.length;
+    normalizer_append(&normalizer, '\0'); // not part of the length
+    char *text = realloc(normalizer.text, normalizer.length); // release the file sized slack
+    return text ? text : normalizer.text;
+}
+
+/* Index file layout: header, text padded to 8 bytes, sa, lcp (in suffix
+   array order, lcp[i] = LCP of suffixes sa[i - 1] and sa[i], lcp[0] = 0) */
+typedef struct SuffixIndexHeader {
+    char magic[8];
+    uint64_t text_length;
+    uint64_t entry_width; // bytes per sa and lcp entry, 4 or 8
+} SuffixIndexHeader;
+
+/* Index mapped from a file */
+typedef struct SuffixIndex {
+    void *map;
+    size_t map_size;
+    const char *text;
+    uint64_t length;
+    int entry_width;
+    const void *sa;
+    const void *lcp;
+} SuffixIndex;
+
+void set_suffix_entry(void *entries, int width, int64_t i, int64_t value){
+    if (width == 4){
+        ((int32_t *)entries)[i] = (int32_t)value;
+    }
+    else {
+        ((int64_t *)entries)[i] = value;
+    }
+}
+
+/* Bytes of the in-memory construction: SA and PLCP with the sentinel entry
+   and the SA-IS type bits */
+uint64_t suffix_in_memory_bytes(uint64_t n){
+    return 2 * (n + 1) * suffix_entry_width(n) + n / 8 + 1;
+}
+
+/* Bytes of the bucketed construction besides its pass buffer, the key
+   counters of the counting threads and their sum */
+uint64_t suffix_bucketed_overhead(void){
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    return (uint64_t)(num_threads + 1) * SUFFIX_KEYS * sizeof(int64_t);
+}
+
+/* State of a bucketed construction, the text, sa and lcp are sections of the
+   mapped index file */
+typedef struct BucketedSuffixBuild {
+    const unsigned char *text;
+    int64_t n;
+    int width;
+    void *sa;
+    void *lcp;
+    int64_t rank;       // entries written so far
+    int64_t previous;   // suffix at rank - 1, -1 before the first
+    int64_t *positions; // pass buffer of allocated entries
+    int64_t allocated;
+    int64_t capacity;   // positions per pass within the budget
+    int64_t *scratch;   // [SUFFIX_KEYS] key counts, then key -> bucket of a pass
+    int over_budget;    // a bucket had to be sorted in one oversized pass
+} BucketedSuffixBuild;
+
+/* Key of the two symbols at depth of suffix i, symbols shifted up by one so
+   the end of the text sorts first */
+static inline int64_t suffix_key(const unsigned char *text, int64_t n, int64_t i, int64_t depth){
+    int64_t a = (i + depth < n) ? text[i + depth] + 1 : 0;
+    int64_t b = (i + depth + 1 < n) ? text[i + depth + 1] + 1 : 0;
+    return a * 257 + b;
+}
+
+static inline int suffix_has_prefix(const BucketedSuffixBuild *build, int64_t i, const unsigned char *prefix,
+                                    int64_t depth){
+    return depth == 0 || (i + depth <= build->n && memcmp(build->text + i, prefix, depth) == 0);
+}
+
+/* Suffix comparison of one bucket, which share depth symbols, qsort() has no
+   context argument so it is per thread */
+static _Thread_local const unsigned char *suffix_sort_text;
+static _Thread_local int64_t suffix_sort_n;
+static _Thread_local int64_t suffix_sort_depth;
+
+static int compare_suffixes(const void *a, const void *b){
+    int64_t i = *(const int64_t *)a + suffix_sort_depth;
+    int64_t j = *(const int64_t *)b + suffix_sort_depth;
+    int64_t li = suffix_sort_n - i, lj = suffix_sort_n - j;
+    int cmp = memcmp(suffix_sort_text + i, suffix_sort_text + j, (li < lj) ? li : lj);
+    if (cmp != 0){
+        return cmp;
+    }
+    return (li < lj) ? -1 : 1; // suffixes differ in length, the shorter ends first
+}
+
+static int64_t common_prefix(const unsigned char *text, int64_t n, int64_t i, int64_t j){
+    int64_t h = 0;
+    while (i + h < n && j + h < n && text[i + h] == text[j + h]){
+        h++;
+    }
+    return h;
+}
+
+/* Sort and write the suffixes with prefix whose key at depth is one of the
+   num_keys keys of keys[] (ascending, counts[] of them, total in all) */
+static void bucketed_pass(BucketedSuffixBuild *build, const unsigned char *prefix, int64_t depth,
+                          const int64_t *keys, const int64_t *counts, int64_t num_keys, int64_t total){
+    if (total > build->allocated){
+        int64_t *grown = realloc(build->positions, total * sizeof(int64_t));
+        if (!grown){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        build->positions = grown;
+        build->allocated = total;
+        build->over_budget = 1;
+    }
+    const unsigned char *text = build->text;
+    int64_t n = build->n;
+    int64_t *positions = build->positions;
+    int64_t low = keys[0], high = keys[num_keys - 1];
+
+    /* gather in parallel, each thread reserves room for a batch at a time */
+    int64_t filled = 0;
+    #pragma omp parallel
+    {
+        int64_t batch[SUFFIX_GATHER_BATCH];
+        int size = 0;
+        #pragma omp for schedule(static)
+        for (int64_t i = 0; i < n; i++){
+            int64_t key = suffix_key(text, n, i, depth);
+            if (key >= low && key <= high && suffix_has_prefix(build, i, prefix, depth)){
+                batch[size++] = i;
+                if (size == SUFFIX_GATHER_BATCH){
+                    int64_t at;
+                    #pragma omp atomic capture
+                    { at = filled; filled += size; }
+                    memcpy(positions + at, batch, size * sizeof(int64_t));
+                    size = 0;
+                }
+            }
+        }
+        int64_t at;
+        #pragma omp atomic capture
+        { at = filled; filled += size; }
+        memcpy(positions + at, batch, size * sizeof(int64_t));
+    }
+
+    /* partition by key in place (American flag sort), bucket b of the pass
+       is [begin[b], begin[b + 1]) */
+    int64_t *begin = malloc((num_keys + 1) * sizeof(int64_t));
+    int64_t *next = malloc(num_keys * sizeof(int64_t));
+    if (!begin || !next){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    begin[0] = 0;
+    for (int64_t b = 0; b < num_keys; b++){
+        build->scratch[keys[b]] = b;
+        begin[b + 1] = begin[b] + counts[b];
+        next[b] = begin[b];
+    }
+    for (int64_t b = 0; b < num_keys; b++){
+        while (next[b] < begin[b + 1]){
+            int64_t target = build->scratch[suffix_key(text, n, positions[next[b]], depth)];
+            if (target == b){
+                next[b]++;
+            }
+            else {
+                int64_t tmp = positions[next[b]];
+                positions[next[b]] = positions[next[target]];
+                positions[next[target]++] = tmp;
+            }
+        }
+    }
+
+    /* buckets are sorted in parallel, then written in order with the LCP of
+       every suffix and the one before it */
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int64_t b = 0; b < num_keys; b++){
+        if (counts[b] > 1){
+            suffix_sort_text = text;
+            suffix_sort_n = n;
+            suffix_sort_depth = depth + 2;
+            qsort(positions + begin[b], counts[b], sizeof(int64_t), compare_suffixes);
+        }
+    }
+    int64_t rank = build->rank, previous = build->previous;
+    #pragma omp parallel for schedule(static)
+    for (int64_t k = 0; k < total; k++){
+        int64_t before = (k > 0) ? positions[k - 1] : previous;
+        set_suffix_entry(build->sa, build->width, rank + k, positions[k]);
+        set_suffix_entry(build->lcp, build->width, rank + k,
+                         (before < 0) ? 0 : common_prefix(text, n, before, positions[k]));
+    }
+    build->rank += total;
+    build->previous = positions[total - 1];
+    free(begin);
+    free(next);
+}
+
+/* Suffixes with prefix (depth symbols) in order: counted by the key of their
+   next two symbols, keys are grouped into passes that fit the buffer and a
+   key with more suffixes than that is split by the two symbols after it */
+static void bucketed_level(BucketedSuffixBuild *build, const unsigned char *prefix, int64_t depth){
+    const unsigned char *text = build->text;
+    int64_t n = build->n;
+    int64_t *counts = build->scratch;
+    memset(counts, 0, SUFFIX_KEYS * sizeof(int64_t));
+    #pragma omp parallel
+    {
+        int64_t *local = calloc(SUFFIX_KEYS, sizeof(int64_t));
+        if (!local){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        #pragma omp for schedule(static)
+        for (int64_t i = 0; i < n; i++){
+            if (suffix_has_prefix(build, i, prefix, depth)){
+                local[suffix_key(text, n, i, depth)]++;
+            }
+        }
+        for (int64_t key = 0; key < SUFFIX_KEYS; key++){
+            if (local[key] > 0){
+                #pragma omp atomic
+                counts[key] += local[key];
+            }
+        }
+        free(local);
+    }
+
+    /* keep the keys that occur, the scratch array is reused by deeper levels */
+    int64_t num_keys = 0;
+    for (int64_t key = 0; key < SUFFIX_KEYS; key++){
+        num_keys += (counts[key] > 0);
+    }
+    int64_t *keys = malloc((num_keys + 1) * sizeof(int64_t));
+    int64_t *key_counts = malloc((num_keys + 1) * sizeof(int64_t));
+    if (!keys || !key_counts){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int64_t key = 0, k = 0; key < SUFFIX_KEYS; key++){
+        if (counts[key] > 0){
+            keys[k] = key;
+            key_counts[k++] = counts[key];
+        }
+    }
 
-#define HASH_TABLE_SIZE 10000
-#define WORD_BUFFER_SIZE 150
+    unsigned char deeper[SUFFIX_MAX_DEPTH];
+    if (depth > 0){
+        memcpy(deeper, prefix, depth);
+    }
+    int64_t group = 0, total = 0;
+    for (int64_t k = 0; k < num_keys; k++){
+        int64_t key = keys[k];
+        int splittable = key / 257 > 0 && key % 257 > 0 && depth + 2 <= SUFFIX_MAX_DEPTH;
+        if (key_counts[k] > build->capacity && splittable){
+            if (total > 0){
+                bucketed_pass(build, prefix, depth, keys + group, key_counts + group, k - group, total);
+            }
+            deeper[depth] = (unsigned char)(key / 257 - 1);
+            deeper[depth + 1] = (unsigned char)(key % 257 - 1);
+            bucketed_level(build, deeper, depth + 2);
+            group = k + 1;
+            total = 0;
+        }
+        else if (total + key_counts[k] > build->capacity && total > 0){
+            bucketed_pass(build, prefix, depth, keys + group, key_counts + group, k - group, total);
+            group = k;
+            total = key_counts[k];
+        }
+        else {
+            total += key_counts[k];
+        }
+    }
+    if (total > 0){
+        bucketed_pass(build, prefix, depth, keys + group, key_counts + group, num_keys - group, total);
+    }
+    free(keys);
+    free(key_counts);
+}
+
+/* Build the index of the corpus at corpus_path, returns the normalized text
+   length or -1 on failure. memory_budget (0 = unlimited) bounds the memory
+   of the construction besides the mapped index file, see Solution 9) */
+int64_t build_suffix_index(const char *corpus_path, const char *index_path, size_t memory_budget){
+    FILE *corpus = fopen(corpus_path, "r");
+    if (!corpus){
+        perror("Failed to open file");
+        return -1;
+    }
+    FILE *file = fopen(index_path, "w+b");
+    if (!file){
+        perror("Failed to open index file");
+        fclose(corpus);
+        return -1;
+    }
+
+    /* normalize straight into the file after the header */
+    SuffixIndexHeader header = {SUFFIX_INDEX_MAGIC, 0, 0};
+    TextNormalizer normalizer = {0};
+    normalizer.out = file;
+    char *read_buffer = malloc(READ_BUFFER_SIZE);
+    if (!read_buffer){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    size_t len;
+    while ((len = fread(read_buffer, 1, READ_BUFFER_SIZE, corpus)) > 0){
+        normalize_block(&normalizer, read_buffer, len);
+    }
+    if (normalizer.length > 0){
+        normalizer_flush(&normalizer);
+    }
+    free(read_buffer);
+    free(normalizer.text);
+    fclose(corpus);
+    ok = ok && !normalizer.write_error && fflush(file) == 0;
+
+    int64_t n = (int64_t)normalizer.written;
+    int width = suffix_entry_width(n);
+    uint64_t text_bytes = (n + 7) / 8 * 8;
+    size_t map_size = sizeof(SuffixIndexHeader) + text_bytes + 2 * n * width;
+    int use_sais = memory_budget == 0 || suffix_in_memory_bytes(n) <= memory_budget;
+    uint64_t min_budget = suffix_bucketed_overhead() + SUFFIX_MIN_PASS * sizeof(int64_t);
+    if (ok && !use_sais && memory_budget < min_budget){
+        fprintf(stderr, "The memory budget must be at least %llu bytes to build the index.\n",
+                (unsigned long long)min_budget);
+        fclose(file);
+        remove(index_path);
+        return -1;
+    }
+    char *map = MAP_FAILED;
+    if (ok && ftruncate(fileno(file), map_size) == 0){
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    }
+    if (map == MAP_FAILED){
+        perror("Failed to write index file");
+        fclose(file);
+        return -1;
+    }
+    const unsigned char *text = (const unsigned char *)map + sizeof(SuffixIndexHeader);
+    char *sa = map + sizeof(SuffixIndexHeader) + text_bytes;
+    char *lcp = sa + n * width;
+
+    if (n > 0 && use_sais){
+        void *sa_memory = malloc((n + 1) * width);
+        void *plcp = malloc((n + 1) * width);
+        if (!sa_memory || !plcp){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        build_suffix_array(text, 1, n, 256, sa_memory);
+        build_plcp(text, 1, n, sa_memory, plcp);
+        memcpy(sa, sa_memory, n * width);
+        #pragma omp parallel for schedule(static)
+        for (int64_t i = 0; i < n; i++){
+            set_suffix_entry(lcp, width, i, suffix_entry(plcp, width, suffix_entry(sa_memory, width, i)));
+        }
+        free(sa_memory);
+        free(plcp);
+    }
+    else if (n > 0){
+        BucketedSuffixBuild build = {text, n, width, sa, lcp, 0, -1, NULL, 0, 0, NULL, 0};
+        build.capacity = (memory_budget - suffix_bucketed_overhead()) / sizeof(int64_t);
+        build.allocated = build.capacity;
+        build.positions = malloc(build.allocated * sizeof(int64_t));
+        build.scratch = malloc(SUFFIX_KEYS * sizeof(int64_t));
+        if (!build.positions || !build.scratch){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        bucketed_level(&build, NULL, 0);
+        if (build.over_budget){
+            fprintf(stderr, "Warning: a prefix of %d characters repeats more than %lld times, its suffixes "
+                    "were sorted in one pass, using %llu bytes of the %zu byte budget\n", SUFFIX_MAX_DEPTH,
+                    (long long)build.capacity,
+                    (unsigned long long)(build.allocated * sizeof(int64_t) + suffix_bucketed_overhead()),
+                    memory_budget);
+        }
+        free(build.positions);
+        free(build.scratch);
+    }
+
+    header.text_length = n;
+    header.entry_width = width;
+    memcpy(map, &header, sizeof(header));
+    ok = munmap(map, map_size) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok){
+        perror("Failed to write index file");
+        return -1;
+    }
+    return n;
+}
+
+/* Map an index built by build_suffix_index(), NULL on failure */
+SuffixIndex *open_suffix_index(const char *path){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        perror("Failed to open index file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SuffixIndexHeader)){
+        fprintf(stderr, "Invalid index file %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        perror("Failed to map index file");
+        return NULL;
+    }
+    const SuffixIndexHeader *header = map;
+    uint64_t n = header->text_length;
+    uint64_t width = header->entry_width;
+    uint64_t text_bytes = (n + 7) / 8 * 8;
+    if (memcmp(header->magic, SUFFIX_INDEX_MAGIC, 8) != 0 || (width != 4 && width != 8)
+        || (uint64_t)st.st_size != sizeof(SuffixIndexHeader) + text_bytes + 2 * n * width){
+        fprintf(stderr, "Invalid index file %s\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    SuffixIndex *index = malloc(sizeof(SuffixIndex));
+    if (!index){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    index->map = map;
+    index->map_size = st.st_size;
+    index->text = (const char *)map + sizeof(SuffixIndexHeader);
+    index->length = n;
+    index->entry_width = (int)width;
+    index->sa = index->text + text_bytes;
+    index->lcp = (const char *)index->sa + n * width;
+    return index;
+}
+
+void close_suffix_index(SuffixIndex *index){
+    munmap(index->map, index->map_size);
+    free(index);
+}
+
+/* Compare the suffix at pos with query, 0 if the query is a prefix of it */
+int compare_suffix(const SuffixIndex *index, uint64_t pos, const char *query, size_t m){
+    uint64_t available = index->length - pos;
+    int cmp = memcmp(index->text + pos, query, (available < m) ? available : m);
+    if (cmp != 0){
+        return cmp;
+    }
+    return (available < m) ? -1 : 0;
+}
+
+/* Occurrences of query (normalized like the corpus) in the corpus */
+uint64_t count_substring(const SuffixIndex *index, const char *query){
+    TextNormalizer normalizer = {0};
+    normalize_block(&normalizer, query, strlen(query));
+    size_t m = normalizer.length;
+    if (m == 0){
+        free(normalizer.text);
+        return 0;
+    }
+
+    /* first suffix not below the query, then first suffix above it */
+    uint64_t low = 0, high = index->length;
+    while (low < high){
+        uint64_t mid = low + (high - low) / 2;
+        if (compare_suffix(index, suffix_entry(index->sa, index->entry_width, mid), normalizer.text, m) < 0){
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    uint64_t first = low;
+    high = index->length;
+    while (low < high){
+        uint64_t mid = low + (high - low) / 2;
+        if (compare_suffix(index, suffix_entry(index->sa, index->entry_width, mid), normalizer.text, m) <= 0){
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    free(normalizer.text);
+    return low - first;
+}
 
 /*******************************************************************************
- * HASH TABLE DEFINITION
+ * PHRASE MINING
  *******************************************************************************/
-/* Hash table is an array of linked lists */
-/* Linked list to deal with collisions of same hash key*/
-typedef struct WordFreqNode {
-    char* word;
-    int count;
-    struct WordFreqNode *next;
-} WordFreqNode;
+/* Corpus as word ids, token t starts at text[token_offset[t]] */
+typedef struct TokenizedText {
+    char *text;            // normalized corpus, NUL terminated
+    int32_t *tokens;
+    int64_t *token_offset;
+    int64_t num_tokens;
+    int32_t num_words;
+} TokenizedText;
 
-/* Use DJB2 Hash Function */
-unsigned int djb2_hash(const char* word){
-    unsigned int hash = 5381;
-    int c;
-    while (c = *word++){
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+/* Open addressing word -> id table over the normalized text */
+typedef struct WordIdTable {
+    int32_t *slots;        // word id or -1, capacity is a power of two
+    int64_t *word_offset;  // first occurrence of every word id
+    size_t capacity;
+} WordIdTable;
+
+size_t word_length(const char *word){
+    return strcspn(word, " ");
+}
+
+void word_id_table_init(WordIdTable *table, size_t capacity){
+    table->capacity = capacity;
+    table->slots = malloc(capacity * sizeof(int32_t));
+    table->word_offset = realloc(table->word_offset, capacity * sizeof(int64_t));
+    if (!table->slots || !table->word_offset){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
     }
-    return hash % HASH_TABLE_SIZE;
+    memset(table->slots, 0xff, capacity * sizeof(int32_t));
 }
 
-/* Create a new WordFreqNode */
-WordFreqNode* create_WordFreqNode(const char *word){
-    WordFreqNode *new_node = (WordFreqNode*)malloc(sizeof(WordFreqNode));
-    if (!new_node) {
+/* Slot of word in the table, empty if the word has no id yet */
+size_t word_id_slot(const WordIdTable *table, const char *text, const char *word, size_t len){
+    size_t slot = fnv1a_64(word, len) & (table->capacity - 1);
+    while (table->slots[slot] >= 0){
+        const char *other = text + table->word_offset[table->slots[slot]];
+        if (word_length(other) == len && memcmp(other, word, len) == 0){
+            break;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return slot;
+}
+
+/* Double the table and re-insert the first num_words ids */
+void word_id_table_grow(WordIdTable *table, const char *text, int32_t num_words){
+    free(table->slots);
+    word_id_table_init(table, 2 * table->capacity);
+    for (int32_t w = 0; w < num_words; w++){
+        const char *word = text + table->word_offset[w];
+        table->slots[word_id_slot(table, text, word, word_length(word))] = w;
+    }
+}
+
+/* Map the normalized corpus of path to word ids in order of first occurrence,
+   returns 0 if the file cannot be read */
+int tokenize_corpus(const char *path, TokenizedText *corpus){
+    size_t length;
+    corpus->text = normalize_file(path, &length);
+    if (!corpus->text){
+        return 0;
+    }
+    int64_t max_tokens = (int64_t)(length + 1) / 2 + 1; // one letter words
+    corpus->tokens = malloc(max_tokens * sizeof(int32_t));
+    corpus->token_offset = malloc(max_tokens * sizeof(int64_t));
+    if (!corpus->tokens || !corpus->token_offset){
         perror("Failed to allocate memory");
         exit(EXIT_FAILURE);
     }
-    new_node->word = strdup(word);
-    new_node->count = 1;
-    new_node->next = NULL;
-    return new_node;
+    WordIdTable table = {0};
+    word_id_table_init(&table, 1024);
+    corpus->num_tokens = 0;
+    corpus->num_words = 0;
+
+    for (size_t start = 0; start < length; ){
+        const char *word = corpus->text + start;
+        size_t len = word_length(word);
+        size_t slot = word_id_slot(&table, corpus->text, word, len);
+        int32_t id = table.slots[slot];
+        if (id < 0){
+            id = corpus->num_words++;
+            table.slots[slot] = id;
+            table.word_offset[id] = start;
+            if ((size_t)corpus->num_words * 2 > table.capacity){
+                word_id_table_grow(&table, corpus->text, corpus->num_words);
+            }
+        }
+        corpus->tokens[corpus->num_tokens] = id;
+        corpus->token_offset[corpus->num_tokens++] = start;
+        start += len + 1;
+    }
+    free(table.slots);
+    free(table.word_offset);
+    return 1;
 }
 
-/* Insert word or update frequency count */
-void add_word(WordFreqNode **table, const char *word){
-    unsigned int search_key = djb2_hash(word);
-    WordFreqNode *node = table[search_key];
+/* Maximal repeat found by the scan, start is its first character */
+typedef struct PhraseCandidate {
+    int64_t count;
+    int64_t length;
+    int64_t start;
+} PhraseCandidate;
 
-    /* Check if word is already in hash table */
-    while (node != NULL){
-        if (strcmp(node->word, word) == 0){
-            node->count++;
+/* Ranking of phrases: higher count, then longer, then earlier in the text
+   order of the suffix array scan */
+int phrase_worse(const PhraseCandidate *a, const PhraseCandidate *b){
+    if (a->count != b->count){
+        return a->count < b->count;
+    }
+    if (a->length != b->length){
+        return a->length < b->length;
+    }
+    return a->start > b->start;
+}
+
+void phrase_heap_swap(PhraseCandidate *heap, int32_t i, int32_t j){
+    PhraseCandidate tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+/* Min-heap of the best candidates, worst at the root */
+void phrase_sift_down(PhraseCandidate *heap, int32_t size, int32_t i){
+    while (1){
+        int32_t worst = i;
+        int32_t left = 2 * i + 1;
+        int32_t right = left + 1;
+        if (left < size && phrase_worse(&heap[left], &heap[worst])){
+            worst = left;
+        }
+        if (right < size && phrase_worse(&heap[right], &heap[worst])){
+            worst = right;
+        }
+        if (worst == i){
             return;
         }
-        node = node->next;
+        phrase_heap_swap(heap, i, worst);
+        i = worst;
     }
+}
 
-    /* Else if not found, add to hash table at top of list */
-    WordFreqNode *new_node = create_WordFreqNode(word);
-    new_node->next = table[search_key];
-    table[search_key] = new_node;
+void phrase_sift_up(PhraseCandidate *heap, int32_t i){
+    while (i > 0 && phrase_worse(&heap[i], &heap[(i - 1) / 2])){
+        phrase_heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
 }
 
-/* Comparison function for quick sort algorithm */
-int compare_by_frequency(const void *a, const void *b){
-    WordFreqNode *node_a = *(WordFreqNode **)a;
-    WordFreqNode *node_b = *(WordFreqNode **)b;
-    return node_b->count - node_a->count; // sort high to low
+int compare_phrase_candidates(const void *a, const void *b){
+    return phrase_worse(a, b) - phrase_worse(b, a); // best first
+}
+
+/* Top k maximal repeated phrases of the file at path with at least min_count
+   occurrences, best first, see Solution 10). Returns NULL if the file cannot
+   be read and sets *num_phrases to the number returned, the array and each
+   text are freed by the caller */
+Phrase *find_frequent_phrases(const char *path, int32_t k, int64_t min_count, int32_t *num_phrases){
+    TokenizedText corpus;
+    if (!tokenize_corpus(path, &corpus)){
+        return NULL;
+    }
+    int64_t n = corpus.num_tokens;
+    if (k > n){
+        k = (int32_t)n; // no more intervals than tokens
+    }
+    int width = suffix_entry_width(n);
+    void *sa = malloc((n + 1) * width);
+    void *plcp = malloc((n + 1) * width);
+    int64_t *changes = malloc((n + 1) * sizeof(int64_t));
+    int64_t *stack_lcp = malloc((n + 1) * sizeof(int64_t));
+    int64_t *stack_lb = malloc((n + 1) * sizeof(int64_t));
+    PhraseCandidate *heap = malloc(((size_t)k + 1) * sizeof(PhraseCandidate));
+    if (!sa || !plcp || !changes || !stack_lcp || !stack_lb || !heap){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    build_suffix_array(corpus.tokens, 4, n, corpus.num_words, sa);
+    build_plcp(corpus.tokens, 4, n, sa, plcp);
+
+    /* changes[i]: ranks j <= i whose preceding word differs from rank j - 1's,
+       the start of the corpus differs from every word */
+    for (int64_t i = 0, prev_pos = 0; i < n; i++){
+        int64_t pos = suffix_entry(sa, width, i);
+        int64_t left = (pos > 0) ? corpus.tokens[pos - 1] : -1;
+        int64_t prev_left = (i > 0 && prev_pos > 0) ? corpus.tokens[prev_pos - 1] : -1;
+        prev_pos = pos;
+        int change = left < 0 || (i > 0 && left != prev_left);
+        changes[i] = (i > 0 ? changes[i - 1] : 0) + change;
+    }
+
+    /* bottom-up LCP intervals, each is examined when it closes */
+    int32_t size = 0;
+    int64_t top = 0;
+    stack_lcp[0] = 0;
+    stack_lb[0] = 0;
+    for (int64_t i = 1; i <= n; i++){
+        int64_t h = (i < n) ? suffix_entry(plcp, width, suffix_entry(sa, width, i)) : 0; // LCP[i]
+        int64_t lb = i - 1;
+        while (stack_lcp[top] > h){
+            int64_t length = stack_lcp[top];
+            lb = stack_lb[top--];
+            int64_t pos = suffix_entry(sa, width, lb);
+            PhraseCandidate candidate = {i - lb, length, corpus.token_offset[pos]};
+            int left_maximal = pos == 0 || changes[i - 1] > changes[lb];
+            if (length < PHRASE_MIN_WORDS || candidate.count < min_count || !left_maximal){
+                continue;
+            }
+            if (size < k){
+                heap[size] = candidate;
+                phrase_sift_up(heap, size++);
+            }
+            else if (k > 0 && phrase_worse(&heap[0], &candidate)){
+                heap[0] = candidate;
+                phrase_sift_down(heap, size, 0);
+            }
+        }
+        if (stack_lcp[top] < h){
+            top++;
+            stack_lcp[top] = h;
+            stack_lb[top] = lb;
+        }
+    }
+
+    /* copy the phrases out of the corpus */
+    qsort(heap, size, sizeof(PhraseCandidate), compare_phrase_candidates);
+    Phrase *phrases = calloc((size_t)size + 1, sizeof(Phrase));
+    if (!phrases){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int32_t i = 0; i < size; i++){
+        const char *start = corpus.text + heap[i].start;
+        const char *end = start;
+        for (int64_t w = 0; w < heap[i].length; w++){
+            end += word_length(end) + (w + 1 < heap[i].length);
+        }
+        phrases[i].text = strndup(start, end - start);
+        if (!phrases[i].text){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        phrases[i].count = heap[i].count;
+        phrases[i].length = heap[i].length;
+    }
+    *num_phrases = size;
+
+    free(corpus.text);
+    free(corpus.tokens);
+    free(corpus.token_offset);
+    free(sa);
+    free(plcp);
+    free(changes);
+    free(stack_lcp);
+    free(stack_lb);
+    free(heap);
+    return phrases;
 }
 
 /*******************************************************************************
  * SOLUTION
  *******************************************************************************/
 
-/* Function below can be refactored into multiple functions */
-char **find_frequent_words(const char *path, int32_t n){
+/* Function below can be refactored into multiple functions
+   options (optional) select memory budget and statistics, report (optional)
+   receives the counting mode and statistics */
+char **find_frequent_words_with_options(const char *path, int32_t n, const FreqOptions *options,
+                                        FreqReport *report){
+    FreqOptions default_options = {0};
+    if (!options){
+        options = &default_options;
+    }
+    if (options->memory_budget > 0 && options->memory_budget < min_memory_budget(options)){
+        fprintf(stderr, "The memory budget must be at least %zu bytes, the fixed table overhead and one word.\n",
+                min_memory_budget(options));
+        return NULL;
+    }
+
     FILE *file = fopen(path, "r");
     if (!file) {
         perror("Failed to open file");
         return NULL;
     }
     
-    /* Read in file, a character at a time, discard non {a-z,A-Z} characters
+    /* Read in file, a block at a time, discard non {a-z,A-Z} characters
        Consider apostrophes such as the word know't that appears in Shakespeare
        as a single word. Upper case and lower case are treated the same */
-    WordFreqNode *hash_table[HASH_TABLE_SIZE] = {0};
+    WordFreqTable *hash_table = calloc(1, sizeof(WordFreqTable));
+    if (!hash_table){
+        perror("Failed to allocate memory");
+        fclose(file);
+        return NULL;
+    }
+    hash_table->memory_used = sizeof(WordFreqTable);
+    hash_table->memory_budget = options->memory_budget;
+    hash_table->track_case = options->original_case;
+    hash_table->track_locations = options->sample_locations;
+    if (options->compute_stats && (options->memory_budget > 0 || options->two_stage)){
+        /* the table may lose track of distinct words, see update_distinct() */
+        hash_table->distinct_sketch = calloc(HLL_REGISTERS, 1);
+        if (!hash_table->distinct_sketch){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        hash_table->memory_used += HLL_REGISTERS;
+    }
+    if (options->two_stage){
+        /* size the filter from the file, at most half of the budget left
+           after the table, no filter (every word counted) if none is left */
+        fseek(file, 0, SEEK_END);
+        long file_size = ftell(file);
+        rewind(file);
+        size_t max_bytes = 0;
+        if (options->memory_budget > 0){
+            size_t left = (options->memory_budget > hash_table->memory_used)
+                          ? options->memory_budget - hash_table->memory_used : 0;
+            max_bytes = (left / 2 > 0) ? left / 2 : 1;
+        }
+        hash_table->first_sightings = create_bloom_filter(file_size > 0 ? (uint64_t)file_size : 0, max_bytes);
+        if (hash_table->first_sightings){
+            hash_table->memory_used += bloom_filter_memory(hash_table->first_sightings);
+        }
+    }
+    char *read_buffer = malloc(READ_BUFFER_SIZE);
+    if (!read_buffer){
+        perror("Failed to allocate memory");
+        free(hash_table);
+        fclose(file);
+        return NULL;
+    }
     char word_buffer[WORD_BUFFER_SIZE];
-    int c;
     int pos = 0; // position in word_buffer
+    uint64_t case_mask = 0; // uppercase letters of word in buffer
+    uint64_t file_offset = 0; // offset of read_buffer in file
+    uint64_t word_offset = 0; // offset of word in buffer
+    LocationSampler sampler = {0x9E3779B97F4A7C15ULL, read_buffer, 0, 1};
+    FreqReport stats = {0};
+    stats.next_checkpoint = 1;
 
     /* Read the file and allocate the hash table */
-    while ((c = fgetc(file)) != EOF){
-        if (isalpha(c) || (c == '\'' && pos > 0)){
-            /* Prevent buffer overflow */
-            if (pos < WORD_BUFFER_SIZE - 1){
-                word_buffer[pos] = tolower(c);
-                pos++;
+    size_t len;
+    while ((len = fread(read_buffer, 1, READ_BUFFER_SIZE, file)) > 0){
+        for (size_t i = 0; i < len; i++){
+            int c = (unsigned char)read_buffer[i];
+            if (is_word_char(c, pos)){
+                if (pos == 0){
+                    word_offset = file_offset + i;
+                }
+                /* Prevent buffer overflow */
+                if (pos < WORD_BUFFER_SIZE - 1){
+                    word_buffer[pos] = tolower(c);
+                    case_mask |= (uint64_t)(isupper(c) != 0 && pos < CASE_MASK_BITS) << (pos & (CASE_MASK_BITS - 1));
+                    pos++;
+                }
             }
-        }
-        else {
-            /* not valid word character */
-            if (pos > 0){
-                /* valid word in buffer, add to hash table/update count */
-                word_buffer[pos] = '\0';
-                add_word(hash_table, word_buffer);
-                pos = 0; // reset to start of buffer to read next word
+            else {
+                /* not valid word character */
+                if (pos > 0){
+                    /* valid word in buffer, add to hash table/update count */
+                    word_buffer[pos] = '\0';
+                    WordFreqNode *node = count_word(hash_table, word_buffer, case_mask, &stats);
+                    if (options->sample_locations && node){
+                        sample_location(node, &sampler, word_offset, i);
+                    }
+                    pos = 0; // reset to start of buffer to read next word
+                    case_mask = 0;
+                }
             }
         }
+        /* count remaining newlines before the buffer is refilled */
+        if (options->sample_locations){
+            advance_lines(&sampler, len);
+            sampler.scan_pos = 0;
+        }
+        file_offset += len;
     }
 
     /* Reached end of file but last word might be in buffer */
     if (pos > 0){
         word_buffer[pos] = '\0';
-        add_word(hash_table, word_buffer);
+        WordFreqNode *node = count_word(hash_table, word_buffer, case_mask, &stats);
+        if (options->sample_locations && node){
+            sample_location(node, &sampler, word_offset, 0);
+        }
     }
 
+    free(read_buffer);
     fclose(file);
+    update_distinct(hash_table, &stats);
+    add_checkpoint(&stats); // end of corpus
 
     /* Translate the WordFreqNodes in the hash table into an array of WordFreqNodes
        so that qsort algorithm can be used */
-    WordFreqNode *word_linked_list[HASH_TABLE_SIZE];
-    int count = 0;
+    size_t count = hash_table->num_nodes;
+    WordFreqNode **word_linked_list = malloc((count + 1) * sizeof(WordFreqNode *));
+    if (!word_linked_list){
+        perror("Failed to allocate memory");
+        return NULL;
+    }
+    count = 0;
 
     /* iterate through each hash table index */
     for (int i = 0; i < HASH_TABLE_SIZE; i++){
-        WordFreqNode *node = hash_table[i];
+        WordFreqNode *node = hash_table->buckets[i];
         while (node){
             /* iterate through linked list in hash table*/
             word_linked_list[count] = node;
@@ -160,31 +2237,106 @@ char **find_frequent_words(const char *path, int32_t n){
         }
     }
 
-    /* Sort array by word count */
-    qsort(word_linked_list, count, sizeof(WordFreqNode *), compare_by_frequency);
+    /* Sort array by word count, full ranking uses radix sort */
+    if ((size_t)n >= count || options->compute_stats){
+        radix_sort_by_frequency(word_linked_list, count);
+    }
+    else {
+        qsort(word_linked_list, count, sizeof(WordFreqNode *), compare_by_frequency);
+    }
+
+    if (options->compute_stats){
+        fit_heaps_law(&stats);
+        fit_zipf_law(&stats, word_linked_list, count);
+    }
+    stats.mode = hash_table->mode;
+    stats.memory_used = hash_table->memory_used;
+    stats.memory_overhead = sizeof(WordFreqTable) + (hash_table->distinct_sketch ? HLL_REGISTERS : 0);
+    if (hash_table->first_sightings){
+        stats.filter_bytes = bloom_filter_memory(hash_table->first_sightings);
+        stats.false_positive_rate = bloom_false_positive_rate(hash_table->first_sightings);
+    }
+    for (size_t i = 0; i < count && i < (size_t)n; i++){
+        if (word_linked_list[i]->error > stats.max_error){
+            stats.max_error = word_linked_list[i]->error;
+        }
+    }
+    if (options->sample_locations){
+        size_t num_results = ((size_t)n < count) ? (size_t)n : count;
+        stats.locations = calloc(num_results * LOCATION_SAMPLES + 1, sizeof(WordLocation));
+        if (!stats.locations){
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < num_results; i++){
+            WordLocation *locations = stats.locations + i * LOCATION_SAMPLES;
+            memcpy(locations, word_linked_list[i]->samples->slot, sizeof(word_linked_list[i]->samples->slot));
+            qsort(locations, LOCATION_SAMPLES, sizeof(WordLocation), compare_by_offset);
+        }
+    }
+    size_t num_counts = ((size_t)n < count) ? (size_t)n : count;
+    stats.counts = malloc((num_counts + 1) * sizeof(int));
+    if (!stats.counts){
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_counts; i++){
+        stats.counts[i] = word_linked_list[i]->count;
+    }
+    if (report){
+        *report = stats;
+    }
+    else {
+        free(stats.locations);
+        free(stats.counts);
+    }
 
-    /* Gather results */
-    char **result = malloc(n * sizeof(char *));
+    /* Gather results, NULL terminated when there are fewer than n words */
+    size_t num_results = ((size_t)n < count) ? (size_t)n : count;
+    char **result = calloc(num_results + 1, sizeof(char *));
     if (!result){
         perror("Failed to allocate memory");
+        free(word_linked_list);
         return NULL;
     }
 
     /* Top n frequent words */
-    for (int i = 0; i < n; i++) {
-        if (i < count) {
+    for (size_t i = 0; i < num_results; i++) {
+        if (options->original_case){
+            result[i] = dominant_form(word_linked_list[i]);
+        }
+        else {
             result[i] = strdup(word_linked_list[i]->word);
-            if (!result[i]) {
-                perror("Failed to allocate memory");
-                free(result);
-                return NULL;
-            }
         }
+        if (!result[i]) {
+            perror("Failed to allocate memory");
+            free(result);
+            free(word_linked_list);
+            return NULL;
+        }
+    }
+
+    /* Release hash table */
+    for (size_t i = 0; i < count; i++){
+        free(word_linked_list[i]->word);
+        free(word_linked_list[i]);
     }
+    free(word_linked_list);
+    free(hash_table->heap);
+    free(hash_table->distinct_sketch);
+    if (hash_table->first_sightings){
+        free(hash_table->first_sightings->bits);
+        free(hash_table->first_sightings);
+    }
+    free(hash_table);
 
     return result;
 }
 
+char **find_frequent_words(const char *path, int32_t n){
+    return find_frequent_words_with_options(path, n, NULL, NULL);
+}
+
 /*******************************************************************************
  * MAIN FUNCTION
  *******************************************************************************/
@@ -193,9 +2345,105 @@ int main(int argc, char *argv[]){
     const char *default_filepath = "shakespeare.txt";
     int32_t default_n = 20;
 
-    // Use command-line arguments if provided
-    const char *filepath = (argc > 1) ? argv[1] : default_filepath;
-    int n = (argc > 2) ? atoi(argv[2]) : default_n;
+    // Use command-line arguments if provided, n = "all" ranks the full vocabulary
+    // options: --stats prints Heaps' and Zipf's law statistics
+    //          --memory-budget <bytes>[K|M|G] bounds memory of the word counts
+    //                          (or of --build-index)
+    //          --original-case prints the most common original form of each word
+    //          --locations prints sampled line numbers and offsets of each word
+    //          --counts prints the count of each word
+    //          --two-stage adds words to the table on their second sighting
+    //          --build-index <index> writes a suffix array index of the file,
+    //                        needs about 8 bytes of memory per character of
+    //                        normalized text (16 from 2^31 characters), builds
+    //                        in bounded buckets within --memory-budget instead
+    //          --query-index <index> <text> counts occurrences of text
+    //          --phrases returns the n most frequent repeated phrases instead
+    //          --min-count <count> least occurrences of a phrase (default 2)
+    const char *filepath = default_filepath;
+    int32_t n = default_n;
+    FreqOptions options = {0};
+    int show_counts = 0;
+    const char *build_index_path = NULL;
+    const char *query_index_path = NULL;
+    const char *query = NULL;
+    int find_phrases = 0;
+    int64_t min_count = 2;
+    int num_positional = 0;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--stats") == 0){
+            options.compute_stats = 1;
+        }
+        else if (strcmp(argv[i], "--original-case") == 0){
+            options.original_case = 1;
+        }
+        else if (strcmp(argv[i], "--locations") == 0){
+            options.sample_locations = 1;
+        }
+        else if (strcmp(argv[i], "--counts") == 0){
+            show_counts = 1;
+        }
+        else if (strcmp(argv[i], "--two-stage") == 0){
+            options.two_stage = 1;
+        }
+        else if (strcmp(argv[i], "--build-index") == 0 && i + 1 < argc){
+            build_index_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--phrases") == 0){
+            find_phrases = 1;
+        }
+        else if (strcmp(argv[i], "--min-count") == 0 && i + 1 < argc){
+            min_count = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--query-index") == 0 && i + 2 < argc){
+            query_index_path = argv[++i];
+            query = argv[++i];
+        }
+        else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc){
+            char *suffix;
+            double budget = strtod(argv[++i], &suffix);
+            switch (toupper((unsigned char)*suffix)){
+                case 'G': budget *= 1024.0;  /* fall through */
+                case 'M': budget *= 1024.0;  /* fall through */
+                case 'K': budget *= 1024.0;
+            }
+            if (budget <= 0){
+                fprintf(stderr, "The memory budget must be a positive size.\n");
+                return EXIT_FAILURE;
+            }
+            options.memory_budget = (size_t)budget;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0){
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        else if (num_positional == 0){
+            filepath = argv[i];
+            num_positional++;
+        }
+        else if (num_positional == 1){
+            n = (strcmp(argv[i], "all") == 0) ? INT32_MAX : atoi(argv[i]);
+            num_positional++;
+        }
+    }
+
+    if (query_index_path){
+        SuffixIndex *index = open_suffix_index(query_index_path);
+        if (!index){
+            return EXIT_FAILURE;
+        }
+        printf("%s: %llu\n", query, (unsigned long long)count_substring(index, query));
+        close_suffix_index(index);
+        return EXIT_SUCCESS;
+    }
+    if (build_index_path){
+        int64_t length = build_suffix_index(filepath, build_index_path, options.memory_budget);
+        if (length < 0){
+            return EXIT_FAILURE;
+        }
+        printf("Indexed %lld characters of %s into %s\n", (long long)length, filepath, build_index_path);
+        return EXIT_SUCCESS;
+    }
 
     // Validate the value of n
     if (n <= 0) {
@@ -203,23 +2451,93 @@ int main(int argc, char *argv[]){
         return EXIT_FAILURE;
     }
 
+    if (find_phrases){
+        int32_t num_phrases;
+        Phrase *phrases = find_frequent_phrases(filepath, n, min_count, &num_phrases);
+        if (!phrases){
+            fprintf(stderr, "Failed to retrieve the most frequent phrases.\n");
+            return EXIT_FAILURE;
+        }
+        printf("Top %d most frequent phrases:\n", num_phrases);
+        for (int32_t i = 0; i < num_phrases; i++){
+            printf("%d: %s", i + 1, phrases[i].text);
+            if (show_counts){
+                printf(" %lld", (long long)phrases[i].count);
+            }
+            printf("\n");
+            free(phrases[i].text);
+        }
+        free(phrases);
+        return EXIT_SUCCESS;
+    }
+
     // Call the function to get the most frequent words
-    char **frequent_words = find_frequent_words(filepath, n);
+    FreqReport report;
+    char **frequent_words = find_frequent_words_with_options(filepath, n, &options, &report);
 
     if (!frequent_words) {
         fprintf(stderr, "Failed to retrieve the most frequent words.\n");
         return EXIT_FAILURE;
     }
 
-    // Print the results
-    printf("Top %d most frequent words:\n", n);
-    for (int i = 0; i < n; i++) {
-        if (frequent_words[i]) {
-            printf("%d: %s\n", i + 1, frequent_words[i]);
-            free(frequent_words[i]);  // Free each string
+    // Print the results, array is NULL terminated if vocabulary is smaller than n
+    int num_words = 0;
+    while (num_words < n && frequent_words[num_words]) {
+        num_words++;
+    }
+    printf("Top %d most frequent words:\n", num_words);
+    for (int i = 0; i < num_words; i++) {
+        printf("%d: %s", i + 1, frequent_words[i]);
+        if (show_counts){
+            printf(" %d", report.counts[i]);
+        }
+        if (options.sample_locations){
+            for (int k = 0; k < LOCATION_SAMPLES; k++){
+                const WordLocation *location = &report.locations[i * LOCATION_SAMPLES + k];
+                if (location->line > 0){
+                    printf(" %u:%llu", location->line, (unsigned long long)location->offset);
+                }
+            }
         }
+        printf("\n");
+        free(frequent_words[i]);  // Free each string
     }
     free(frequent_words);  // Free the array itself
+    free(report.locations);
+    free(report.counts);
+
+    if (options.memory_budget > 0){
+        printf("\nMemory used: %zu of %zu bytes (%zu bytes fixed table overhead)\n",
+               report.memory_used, options.memory_budget, report.memory_overhead);
+        if (report.mode == COUNT_MODE_EXACT){
+            printf("Counting mode: exact\n");
+        }
+        else {
+            printf("Counting mode: approximate (Space-Saving), counts may be overestimated by up to %d\n",
+                   report.max_error);
+        }
+    }
+
+    if (options.two_stage && report.filter_bytes > 0){
+        printf("\nTwo-stage counting: %zu byte filter, estimated false positive rate %.2g%%, "
+               "words seen once are not ranked\n", report.filter_bytes, 100.0 * report.false_positive_rate);
+    }
+    else if (options.two_stage){
+        printf("\nTwo-stage counting: no memory left for the filter within the budget, every word was counted\n");
+    }
+
+    if (options.compute_stats){
+        printf("\nTokens: %llu, distinct words: %llu%s\n",
+               (unsigned long long)report.num_tokens, (unsigned long long)report.num_distinct,
+               report.distinct_estimated ? " (HyperLogLog estimate, ~1.6% standard error)" : "");
+        printf("Heaps' law: V = %.3f * N^%.4f\n", report.heaps_k, report.heaps_beta);
+        printf("Zipf's law exponent: %.4f\n", report.zipf_exponent);
+        printf("Vocabulary growth (tokens, distinct words):\n");
+        for (int i = 0; i < report.num_checkpoints; i++){
+            printf("%llu %llu\n", (unsigned long long)report.checkpoint_tokens[i],
+                   (unsigned long long)report.checkpoint_distinct[i]);
+        }
+    }
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
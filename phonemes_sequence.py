@@ -47,9 +47,125 @@
 #      point so that results can be reused in the iterative process
 #  iv) By end of iteration, all possible combinations words that match the entire
 #      phoneme sequence will be stored at the last index = len(phonemes)
-#     
+#
+# 3) The preprocessed dictionary is held by a PronunciationIndex that is built
+#    once and shared by all queries. It only looks back as far as the longest
+#    pronunciation, and is saved in the compiled format of 7), which is
+#    mapped with mmap and queried without re-parsing the text dictionary
+#
+# 4) Word matches are found by walking a trie of pronunciations forward from each
+#    position instead of hashing every (j, i) slice as a tuple. Phonemes are
+#    interned to u8 IDs and the trie is kept in flat arrays so the native engine
+#    in phonemes_trie.c can walk it without allocation:
+#      gcc -O2 -shared -fPIC phonemes_trie.c -o libphonemes_trie.so
+#    Without the library the same trie walk is done in Python
+#
+# 5) Storing every word combination in results[] is exponential when short
+#    ambiguous words repeat, so the matches are kept as a word lattice instead:
+#   i) a DAG over positions 0..n with an edge (start, end, word) per match, and
+#      an edge (i-1, i, None) skipping phoneme i-1 when no word ends at i (same
+#      as copying results[i-1] into results[i] above)
+#  ii) paths[i] = number of segmentations of phonemes[0:i], the sum of paths[start]
+#      over edges ending at i, so the number of combinations is paths[n]
+# iii) combinations are produced lazily by a depth first search back from n that
+#      only follows edges whose start has paths > 0, in the same order as
+#      results[n], so memory stays linear in the input
+#
+# 6) When only the most plausible segmentations are needed they are ranked by
+#    unigram word frequencies (e.g. most_freq_words.c --counts output):
+#   i) cost of a word = -log P(word), add-one smoothed so unseen words are
+#      allowed, cost of a path = sum of the costs of its words
+#  ii) Viterbi pass over the lattice gives the best path to every position
+# iii) further paths are extracted lazily with the recursive enumeration
+#      algorithm: the r-th best path to a position is the next entry of a heap
+#      of (predecessor path + edge) candidates, which only asks the predecessor
+#      for its next path when that candidate is used. Finding k paths costs
+#      O(n * k * log k) instead of enumerating and sorting all combinations
+#
+# 7) A full text dictionary (CMUdict "WORD  P1 P2 ..." or "WORD: P1 P2 ..."
+#    lines) takes seconds to parse, so it can be compiled once into a binary
+#    file that is mapped with mmap at startup and used without parsing:
+#      python phonemes_sequence.py --compile cmudict.dict cmudict.bin
+#   i) the trie is minimized into a DAWG: identical subtrees (same words and
+#      same children, e.g. "T OW" -> TOMATO after both "AA" and "EY") are
+#      stored once, nodes are hash-consed bottom up
+#  ii) sections are the flat trie arrays used by phonemes_trie.c, 4-byte
+#      aligned little-endian, so the native engine reads the mapped pages
+#      directly and processes using the same file share them:
+#        header:       magic "PRDG", version, #phonemes, #nodes, #edges,
+#                      #word refs, #words, max length, pool size (u32)
+#        phonemes:     8 byte NUL padded symbols, position = u8 ID
+#        edge_start:   u32[#nodes + 1]      edge_child: u32[#edges]
+#        word_start:   u32[#nodes + 1]      word_ids:   u32[#word refs]
+#        word_offset:  u32[#words + 1] into the string pool
+#        edge_phoneme: u8[#edges]           pool: UTF-8 words
+#
+# 8) Many sequences are segmented with find_word_matches_batch() and
+#    build_word_lattices(): sequences are split into chunks of about
+#    BATCH_CHUNK_PHONEMES phonemes, each chunk is matched with one native call
+#    on a thread pool sharing the read-only index (ctypes releases the GIL
+#    during the call), and results are returned in input order
+#
+# 9) Recognizer output contains phoneme errors, so words can also be matched
+#    approximately (PhonemeErrorModel, see phonemes_trie.c for the search):
+#   i) substitution, insertion and deletion costs per phoneme, edits of a match
+#      may cost at most max_cost, beam_width trie nodes are kept per depth
+#  ii) the lattice keeps the edit cost of every edge, k-best search adds it to
+#      the unigram cost of the word
+#
+# 10) Phonemes from a recognizer arrive one at a time, StreamingSegmenter runs
+#     the same Viterbi search as it goes:
+#   i) the trie walks started at the last max_length positions are kept as
+#      (start, node) states and advanced by each phoneme
+#  ii) best[i] = cheapest segmentation of phonemes[0:i] as a back-pointer chain,
+#      only kept for positions a word can still start from
+# iii) the best paths to all these positions share a prefix, once their back
+#      pointers converge the words before the common position are final, are
+#      returned and dropped. Each hypothesis keeps its live children, a
+#      hypothesis no longer kept and without children is released up the
+#      chain, and the final point moves forward while it has a single child,
+#      so convergence costs amortized O(1) per phoneme
+#  iv) paths that never converge (e.g. A = AH and AA = AH AH, where odd and
+#      even positions disagree from the start) are cut after max_delay
+#      phonemes: the next step of the current best path is made final and the
+#      hypotheses not extending it are dropped, so work per phoneme and
+#      memory stay bounded
+#
+# 11) Ranked searches (k-best and streaming) do not drop unmatched phonemes
+#     silently: the lattice has a skip edge (i-1, i, None) at every position,
+#     costed by a skip penalty (one value, or a per-phoneme mapping), so a path
+#     may skip a phoneme even where a word ends and pays for every skip. By
+#     default a skip costs as much as an unseen word, which is more than any
+#     matched word. find_word_combos_with_pronunciation() keeps the skip rule of
+#     assumption 2 so its output is unchanged
+#
+# 12) Text is converted to phonemes with the reverse index word -> pronunciations
+#     (WordPronunciationIndex, all pronunciations of a word such as TOMATO in
+#     dictionary order). Words are found with a perfect hash built by
+#     hash-and-displace, see phonemes_trie.c, and the compiled dictionary
+#     (version 2) stores it after the trie so it is mapped like the trie:
+#        reverse header: #pronunciations, #pronunciation phonemes, #buckets,
+#                        #slots (u32), right after the header
+#        pron_start:     u32[#words + 1]    pron_offset: u32[#pronunciations + 1]
+#        displacement:   u32[#buckets]      slot_word:   u32[#slots]
+#        pron_phonemes:  u8[#pronunciation phonemes]
+#     Large token streams (e.g. the corpus counted by most_freq_words.c) are
+#     converted by the native engine in one pass:
+#       python phonemes_sequence.py --transcribe cmudict.bin corpus.txt
+#
 
-from typing import List, Sequence, Tuple, Dict
+import bisect
+import ctypes
+import heapq
+import math
+import mmap
+import os
+import re
+import struct
+import sys
+from array import array
+from concurrent.futures import ThreadPoolExecutor
+from typing import Iterable, Iterator, List, Mapping, Optional, Sequence, Tuple, Dict, Union
 
 # Define the pronunciation dictionary as a global variable
 PRONUNCIATION_DICT = [
@@ -61,50 +177,1269 @@ PRONUNCIATION_DICT = [
     ("TOMATO", ["T", "AH", "M", "EY", "T", "OW"])
 ]
 
-def preprocess_dictionary_phoneme_as_key() -> Dict[Tuple[str,...], List[str]]:
+COMPILED_FILE_MAGIC = b"PRDG"
+COMPILED_FILE_VERSION = 2 # version 1 files have no reverse index, it is built on demand
+COMPILED_HEADER = "<4s8I"
+COMPILED_REVERSE_HEADER = "<4I"
+COMPILED_PHONEME_SIZE = 8
+
+HASH_EMPTY = 0xFFFFFFFF # free perfect hash slot, see phonemes_trie.c
+HASH_BUCKET_SIZE = 4    # average words per displacement bucket
+HASH_LOAD_FACTOR = 0.85 # words per slot
+TRANSCRIBE_BUFFER_SIZE = 1 << 20
+
+NATIVE_LIBRARY = "libphonemes_trie.so"
+PHONEME_UNKNOWN = 255 # ID of phonemes not in the dictionary, see phonemes_trie.c
+PHONEME_IDS = 256
+BATCH_CHUNK_PHONEMES = 1 << 16
+STREAMING_MAX_DELAY = 64 # phonemes a streaming decision may stay open
+
+# cost of skipping an unmatched phoneme: one value for all phonemes, a mapping
+# phoneme -> cost (others cost the default), or None for the cost of an unseen word
+SkipPenalty = Union[None, float, Mapping[str, float]]
+
+def load_dictionary_text(path: str, strip_stress: bool = True) -> List[Tuple[str, List[str]]]:
+    # [(word, phonemes)] from CMUdict style text, alternate pronunciations
+    # "WORD(1)" are returned as WORD, stress digits are removed by default
+    # so that phonemes match PRONUNCIATION_DICT (AH0 -> AH)
+    dictionary = []
+    with open(path, encoding="latin-1") as f:
+        for line in f:
+            if not line.strip() or line.startswith(";;;"):
+                continue
+            if ":" in line:
+                word, pronunciation = line.split(":", 1)
+            else:
+                word, _, pronunciation = line.strip().partition(" ")
+            word = word.strip()
+            if word.endswith(")") and "(" in word:
+                word = word[:word.index("(")]
+            phonemes = pronunciation.split()
+            if strip_stress:
+                phonemes = [phoneme.rstrip("012") for phoneme in phonemes]
+            if word and phonemes:
+                dictionary.append((word, phonemes))
+    return dictionary
+
+def preprocess_dictionary_phoneme_as_key(dictionary = PRONUNCIATION_DICT) -> Dict[Tuple[str,...], List[str]]:
     phoneme_to_words = {} 
     # key = tuple of phonemes
     # value = list of words
 
-    for word, phonemes in PRONUNCIATION_DICT:
+    for word, phonemes in dictionary:
         phoneme_tuple = tuple(phonemes)
         if phoneme_tuple not in phoneme_to_words:
             phoneme_to_words[phoneme_tuple] = []
         phoneme_to_words[phoneme_tuple].append(word)
     return phoneme_to_words
 
-def find_word_combos_with_pronunciation(phonemes: Sequence[str]) -> Sequence[Sequence[str]]:
-    phoneme_to_words = preprocess_dictionary_phoneme_as_key();
-    # key = phoneme sequence as a tuple
-    # value = list of words equivalent to the phoneme sequence key
+##################################################################################
+# PRONUNCIATION INDEX
+##################################################################################
+class PronunciationIndex:
+    # Preprocessed dictionary shared by all queries
+    # phoneme_to_words: key = phoneme sequence as a tuple, value = list of words
+    # max_length: longest pronunciation, no need to look back further than this
+    # entries: (word, phonemes) in dictionary order when known, they give the
+    #          order of each word's pronunciations in the reverse index
+
+    def __init__(self, phoneme_to_words: Dict[Tuple[str,...], List[str]],
+                 entries: Optional[List[Tuple[str, List[str]]]] = None):
+        self._phoneme_to_words = phoneme_to_words
+        self._entries = entries
+        self.max_length = max((len(key) for key in phoneme_to_words), default=0)
+        self._trie = None
+        self._reverse = None
+
+    @classmethod
+    def from_trie(cls, trie: "PhonemeTrie", max_length: int,
+                  reverse: Optional["WordPronunciationIndex"] = None) -> "PronunciationIndex":
+        # index backed by a (compiled) trie, phoneme_to_words is rebuilt on demand
+        index = cls({})
+        index._phoneme_to_words = None
+        index._trie = trie
+        index._reverse = reverse
+        index.max_length = max_length
+        return index
+
+    @property
+    def phoneme_to_words(self) -> Dict[Tuple[str,...], List[str]]:
+        if self._phoneme_to_words is None:
+            self._phoneme_to_words = self._trie.to_phoneme_map()
+        return self._phoneme_to_words
+
+    @property
+    def entries(self) -> List[Tuple[str, Sequence[str]]]:
+        # without the dictionary, pronunciations come in phoneme_to_words order
+        if self._entries is None:
+            return [(word, key) for key, words in self.phoneme_to_words.items() for word in words]
+        return self._entries
+
+    @property
+    def trie(self) -> "PhonemeTrie":
+        # built on first use
+        if self._trie is None:
+            self._trie = PhonemeTrie.from_phoneme_map(self.phoneme_to_words)
+        return self._trie
+
+    @property
+    def reverse(self) -> "WordPronunciationIndex":
+        # word -> pronunciations, built on first use unless compiled
+        if self._reverse is None:
+            self._reverse = WordPronunciationIndex.build(self.trie, self.entries)
+        return self._reverse
+
+    @classmethod
+    def from_dictionary(cls, dictionary = PRONUNCIATION_DICT) -> "PronunciationIndex":
+        dictionary = list(dictionary)
+        return cls(preprocess_dictionary_phoneme_as_key(dictionary), dictionary)
+
+    def compile(self, path: str) -> None:
+        # write the minimized trie and the reverse index in the compiled format,
+        # see Solution 7) and 12)
+        trie = self.trie.minimized()
+        trie.save(path, self.max_length, WordPronunciationIndex.build(trie, self.entries))
+
+    @classmethod
+    def load_compiled(cls, path: str) -> "PronunciationIndex":
+        trie, max_length, reverse = PhonemeTrie.load(path)
+        return cls.from_trie(trie, max_length, reverse)
+
+    def save(self, path: str) -> None:
+        # writes the compiled format, see Solution 3) and 7)
+        self.compile(path)
+
+    @classmethod
+    def load(cls, path: str) -> "PronunciationIndex":
+        return cls.load_compiled(path)
+
+def compile_dictionary_text(text_path: str, compiled_path: str, strip_stress: bool = True) -> None:
+    PronunciationIndex.from_dictionary(load_dictionary_text(text_path, strip_stress)).compile(compiled_path)
+
+##################################################################################
+# PRONUNCIATION TRIE (NATIVE ENGINE)
+##################################################################################
+class PhonemeTrie:
+    # Trie of pronunciations in flat arrays, layout shared with phonemes_trie.c
+    # children of node v: edges edge_start[v] .. edge_start[v+1]-1, sorted by ID
+    # edge e: phoneme ID edge_phoneme[e] leading to node edge_child[e]
+    # words of node v: words[word_ids[k]] for k in word_start[v] .. word_start[v+1]-1
+    # node 0 is the root
+
+    def __init__(self, phonemes: List[str], edge_start: array, edge_phoneme: array,
+                 edge_child: array, word_start: array, word_ids: array, words: List[str]):
+        self.phonemes = phonemes
+        self.phoneme_ids = {phoneme: i for i, phoneme in enumerate(phonemes)}
+        self.edge_start = edge_start
+        self.edge_phoneme = edge_phoneme
+        self.edge_child = edge_child
+        self.word_start = word_start
+        self.word_ids = word_ids
+        self.words = words
+        self.num_nodes = len(edge_start) - 1
+        self._native = None
+        self._node_words = {}
+
+    @classmethod
+    def from_phoneme_map(cls, phoneme_to_words: Dict[Tuple[str,...], List[str]]) -> "PhonemeTrie":
+        phonemes = sorted({phoneme for key in phoneme_to_words for phoneme in key})
+        if len(phonemes) >= PHONEME_UNKNOWN:
+            raise ValueError("too many distinct phonemes for u8 IDs")
+        phoneme_ids = {phoneme: i for i, phoneme in enumerate(phonemes)}
+        word_index = {}
+
+        # build trie as dictionaries, node = position in children
+        children = [{}]
+        node_words = [[]]
+        for key, key_words in phoneme_to_words.items():
+            node = 0
+            for phoneme in key:
+                phoneme_id = phoneme_ids[phoneme]
+                if phoneme_id not in children[node]:
+                    children[node][phoneme_id] = len(children)
+                    children.append({})
+                    node_words.append([])
+                node = children[node][phoneme_id]
+            for word in key_words:
+                node_words[node].append(word_index.setdefault(word, len(word_index)))
+
+        # flatten into compressed sparse rows
+        edge_start, edge_phoneme, edge_child = array("I", [0]), array("B"), array("I")
+        word_start, word_ids = array("I", [0]), array("I")
+        for node in range(len(children)):
+            for phoneme_id in sorted(children[node]):
+                edge_phoneme.append(phoneme_id)
+                edge_child.append(children[node][phoneme_id])
+            edge_start.append(len(edge_child))
+            word_ids.extend(node_words[node])
+            word_start.append(len(word_ids))
+        return cls(phonemes, edge_start, edge_phoneme, edge_child, word_start, word_ids, list(word_index))
+
+    def minimized(self) -> "PhonemeTrie":
+        # merge identical subtrees, canonical IDs are assigned in post order so
+        # children are known before their parents
+        post_order = []
+        visited = [False] * self.num_nodes
+        stack = [(0, False)]
+        while stack:
+            node, children_done = stack.pop()
+            if children_done:
+                post_order.append(node)
+            elif not visited[node]:
+                visited[node] = True
+                stack.append((node, True))
+                stack.extend((self.edge_child[e], False)
+                             for e in range(self.edge_start[node], self.edge_start[node + 1]))
+
+        canonical = [0] * self.num_nodes
+        signatures = {}
+        unique_nodes = [] # first node of each canonical ID
+        for node in post_order:
+            edges = range(self.edge_start[node], self.edge_start[node + 1])
+            signature = (tuple(self.word_ids[self.word_start[node]:self.word_start[node + 1]]),
+                         tuple((self.edge_phoneme[e], canonical[self.edge_child[e]]) for e in edges))
+            if signature not in signatures:
+                signatures[signature] = len(unique_nodes)
+                unique_nodes.append(node)
+            canonical[node] = signatures[signature]
+
+        # renumber breadth first from the root so the root stays node 0
+        new_id = {canonical[0]: 0}
+        order = [canonical[0]]
+        for canonical_node in order:
+            node = unique_nodes[canonical_node]
+            for e in range(self.edge_start[node], self.edge_start[node + 1]):
+                child = canonical[self.edge_child[e]]
+                if child not in new_id:
+                    new_id[child] = len(order)
+                    order.append(child)
+
+        edge_start, edge_phoneme, edge_child = array("I", [0]), array("B"), array("I")
+        word_start, word_ids = array("I", [0]), array("I")
+        for canonical_node in order:
+            node = unique_nodes[canonical_node]
+            for e in range(self.edge_start[node], self.edge_start[node + 1]):
+                edge_phoneme.append(self.edge_phoneme[e])
+                edge_child.append(new_id[canonical[self.edge_child[e]]])
+            edge_start.append(len(edge_child))
+            word_ids.extend(self.word_ids[self.word_start[node]:self.word_start[node + 1]])
+            word_start.append(len(word_ids))
+        return PhonemeTrie(self.phonemes, edge_start, edge_phoneme, edge_child, word_start, word_ids, self.words)
+
+    def save(self, path: str, max_length: int, reverse: "WordPronunciationIndex") -> None:
+        # reverse must use the word IDs of this trie
+        if sys.byteorder != "little":
+            raise ValueError("compiled dictionaries are little-endian")
+        encoded_words = [self.words[i].encode("utf-8") for i in range(len(self.words))]
+        word_offset = array("I", [0])
+        for encoded in encoded_words:
+            word_offset.append(word_offset[-1] + len(encoded))
+
+        def aligned(data: bytes) -> bytes:
+            return data + bytes(-len(data) % 4)
+
+        with open(path, "wb") as f:
+            f.write(struct.pack(COMPILED_HEADER, COMPILED_FILE_MAGIC, COMPILED_FILE_VERSION,
+                                len(self.phonemes), self.num_nodes, len(self.edge_child),
+                                len(self.word_ids), len(self.words), max_length, word_offset[-1]))
+            f.write(struct.pack(COMPILED_REVERSE_HEADER, len(reverse.pron_offset) - 1, len(reverse.pron_phonemes),
+                                len(reverse.displacement), len(reverse.slot_word)))
+            for phoneme in self.phonemes:
+                f.write(phoneme.encode("ascii").ljust(COMPILED_PHONEME_SIZE, b"\0"))
+            for section in (self.edge_start, self.edge_child, self.word_start, self.word_ids, word_offset):
+                f.write(array("I", section).tobytes())
+            f.write(aligned(bytes(self.edge_phoneme)))
+            f.write(aligned(b"".join(encoded_words)))
+            for section in (reverse.pron_start, reverse.pron_offset, reverse.displacement, reverse.slot_word):
+                f.write(array("I", section).tobytes())
+            f.write(bytes(reverse.pron_phonemes))
+
+    @classmethod
+    def load(cls, path: str) -> Tuple["PhonemeTrie", int, Optional["WordPronunciationIndex"]]:
+        # map a compiled dictionary, returns (trie, max pronunciation length,
+        # reverse index or None for version 1 files)
+        # copy-on-write mapping: never written, so pages stay shared between
+        # processes, and ctypes can point into it
+        with open(path, "rb") as f:
+            data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+        (magic, version, num_phonemes, num_nodes, num_edges, num_word_refs, num_words,
+         max_length, pool_size) = struct.unpack_from(COMPILED_HEADER, data, 0)
+        if magic != COMPILED_FILE_MAGIC or version not in (1, COMPILED_FILE_VERSION):
+            raise ValueError("%s is not a compiled pronunciation dictionary" % path)
+        view = memoryview(data)
+        offset = struct.calcsize(COMPILED_HEADER)
+        if version >= 2:
+            num_prons, num_pron_phonemes, num_buckets, num_slots = struct.unpack_from(
+                COMPILED_REVERSE_HEADER, data, offset)
+            offset += struct.calcsize(COMPILED_REVERSE_HEADER)
+
+        def section(count: int, itemsize: int) -> memoryview:
+            nonlocal offset
+            values = view[offset:offset + count * itemsize]
+            offset += count * itemsize
+            offset += -offset % 4
+            return values.cast("I") if itemsize == 4 else values
+
+        phonemes = [bytes(section(1, COMPILED_PHONEME_SIZE)).rstrip(b"\0").decode("ascii")
+                    for _ in range(num_phonemes)]
+        edge_start = section(num_nodes + 1, 4)
+        edge_child = section(num_edges, 4)
+        word_start = section(num_nodes + 1, 4)
+        word_ids = section(num_word_refs, 4)
+        word_offset = section(num_words + 1, 4)
+        edge_phoneme = section(num_edges, 1)
+        pool = section(pool_size, 1)
+        trie = cls(phonemes, edge_start, edge_phoneme, edge_child, word_start, word_ids,
+                   StringPool(pool, word_offset))
+        trie._mapping = data # keep the file mapped while the trie is in use
+
+        reverse = None
+        if version >= 2:
+            pron_start = section(num_words + 1, 4)
+            pron_offset = section(num_prons + 1, 4)
+            displacement = section(num_buckets, 4)
+            slot_word = section(num_slots, 4)
+            pron_phonemes = section(num_pron_phonemes, 1)
+            reverse = WordPronunciationIndex(phonemes, trie.words, word_offset, pool, pron_start, pron_offset,
+                                             pron_phonemes, displacement, slot_word)
+            reverse._mapping = data
+        return trie, max_length, reverse
+
+    def to_phoneme_map(self) -> Dict[Tuple[str,...], List[str]]:
+        # all (pronunciation, words), depth first from the root
+        phoneme_to_words = {}
+        stack = [(0, ())]
+        while stack:
+            node, key = stack.pop()
+            if self.word_start[node] != self.word_start[node + 1]:
+                phoneme_to_words[key] = self.node_words(node)
+            for e in range(self.edge_start[node + 1] - 1, self.edge_start[node] - 1, -1):
+                stack.append((self.edge_child[e], key + (self.phonemes[self.edge_phoneme[e]],)))
+        return phoneme_to_words
+
+    def child(self, node: int, phoneme_id: int) -> int:
+        # child of node along phoneme_id, 0 if none
+        lo, hi = self.edge_start[node], self.edge_start[node + 1]
+        e = bisect.bisect_left(self.edge_phoneme, phoneme_id, lo, hi)
+        if e < hi and self.edge_phoneme[e] == phoneme_id:
+            return self.edge_child[e]
+        return 0
+
+    def encode(self, phonemes: Sequence[str]) -> bytes:
+        return bytes(self.phoneme_ids.get(phoneme, PHONEME_UNKNOWN) for phoneme in phonemes)
+
+    def node_words(self, node: int) -> List[str]:
+        # words of node, cached and shared between calls so do not modify
+        words = self._node_words.get(node)
+        if words is None:
+            words = self._node_words[node] = [self.words[self.word_ids[k]]
+                                              for k in range(self.word_start[node], self.word_start[node + 1])]
+        return words
+
+    def native(self) -> Optional["PhonemeTrieStruct"]:
+        # ctypes view of the arrays, None if the native library is not built
+        if self._native is None and _load_native_library() is not None:
+            def pointer(values, ctype):
+                return (ctype * max(len(values), 1)).from_buffer(values) if len(values) else None
+            self._native = PhonemeTrieStruct(
+                self.num_nodes,
+                pointer(self.edge_start, ctypes.c_uint32),
+                pointer(self.edge_phoneme, ctypes.c_uint8),
+                pointer(self.edge_child, ctypes.c_uint32),
+                pointer(self.word_start, ctypes.c_uint32))
+        return self._native
+
+class StringPool:
+    # words of a compiled dictionary, decoded once when first accessed
+    def __init__(self, pool: memoryview, offsets: memoryview):
+        self.pool = pool
+        self.offsets = offsets
+        self.decoded = {}
+
+    def __len__(self) -> int:
+        return len(self.offsets) - 1
+
+    def __getitem__(self, i: int) -> str:
+        word = self.decoded.get(i)
+        if word is None:
+            word = self.decoded[i] = bytes(self.pool[self.offsets[i]:self.offsets[i + 1]]).decode("utf-8")
+        return word
+
+##################################################################################
+# REVERSE INDEX
+##################################################################################
+def _word_hash(word: bytes) -> int:
+    # 64-bit FNV-1a of the upper-cased word, same as word_hash() in phonemes_trie.c
+    value = 0xcbf29ce484222325
+    for byte in word.upper():
+        value = ((value ^ byte) * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return value
+
+def _slot_hash(word_hash: int, d: int) -> int:
+    # splitmix64 finalizer of the word hash and displacement, same as slot_hash()
+    x = word_hash ^ ((d * 0x9e3779b97f4a7c15) & 0xFFFFFFFFFFFFFFFF)
+    x = ((x ^ (x >> 30)) * 0xbf58476d1ce4e5b9) & 0xFFFFFFFFFFFFFFFF
+    x = ((x ^ (x >> 27)) * 0x94d049bb133111eb) & 0xFFFFFFFFFFFFFFFF
+    return x ^ (x >> 31)
+
+class WordPronunciationIndex:
+    # word -> pronunciations, sharing phoneme and word IDs with a PhonemeTrie
+    # pronunciations of word w: pron_phonemes[pron_offset[k]:pron_offset[k+1]]
+    #                           for k in pron_start[w] .. pron_start[w+1]-1
+    # word w is in slot _slot_hash(h, displacement[h % #buckets]) % #slots,
+    # h = _word_hash(w), words are compared without ASCII case
+
+    def __init__(self, phonemes: List[str], words, word_offset, pool, pron_start, pron_offset,
+                 pron_phonemes, displacement, slot_word):
+        self.phonemes = phonemes
+        self.words = words
+        self.word_offset = word_offset
+        self.pool = pool
+        self.pron_start = pron_start
+        self.pron_offset = pron_offset
+        self.pron_phonemes = pron_phonemes
+        self.displacement = displacement
+        self.slot_word = slot_word
+        self._native = None
+
+    @classmethod
+    def build(cls, trie: "PhonemeTrie", entries: Iterable[Tuple[str, Sequence[str]]]) -> "WordPronunciationIndex":
+        # entries: (word, phonemes) of the dictionary, each word's pronunciations
+        # are kept in entry order
+        words = [trie.words[i] for i in range(len(trie.words))]
+        word_ids = {word: i for i, word in enumerate(words)}
+        pronunciations = [[] for _ in words]
+        for word, phonemes in entries:
+            encoded = bytes(trie.phoneme_ids[phoneme] for phoneme in phonemes)
+            if encoded not in pronunciations[word_ids[word]]:
+                pronunciations[word_ids[word]].append(encoded)
+
+        # words differing only in case share the entry of the first one
+        owner = {}
+        for i, word in enumerate(words):
+            key = word.encode("utf-8").upper()
+            if key in owner:
+                merged = pronunciations[owner[key]]
+                merged.extend(encoded for encoded in pronunciations[i] if encoded not in merged)
+            else:
+                owner[key] = i
+
+        # hash-and-displace: place the largest buckets first while slots are free
+        num_buckets = max(1, -(-len(owner) // HASH_BUCKET_SIZE))
+        num_slots = max(1, int(len(owner) / HASH_LOAD_FACTOR) + 1)
+        buckets = [[] for _ in range(num_buckets)]
+        for key, i in owner.items():
+            word_hash = _word_hash(key)
+            buckets[word_hash % num_buckets].append((word_hash, i))
+        displacement = array("I", [0]) * num_buckets
+        slot_word = array("I", [HASH_EMPTY]) * num_slots
+        for bucket in sorted(range(num_buckets), key=lambda b: -len(buckets[b])):
+            if not buckets[bucket]:
+                break
+            for d in range(HASH_EMPTY):
+                slots = [_slot_hash(word_hash, d) % num_slots for word_hash, _ in buckets[bucket]]
+                if len(set(slots)) == len(slots) and all(slot_word[slot] == HASH_EMPTY for slot in slots):
+                    break
+            else:
+                raise ValueError("no perfect hash displacement found")
+            displacement[bucket] = d
+            for slot, (_, i) in zip(slots, buckets[bucket]):
+                slot_word[slot] = i
+
+        encoded_words = [word.encode("utf-8") for word in words]
+        word_offset = array("I", [0])
+        for encoded in encoded_words:
+            word_offset.append(word_offset[-1] + len(encoded))
+        pron_start, pron_offset, pron_phonemes = array("I", [0]), array("I", [0]), bytearray()
+        for word_pronunciations in pronunciations:
+            for encoded in word_pronunciations:
+                pron_phonemes += encoded
+                pron_offset.append(len(pron_phonemes))
+            pron_start.append(len(pron_offset) - 1)
+        return cls(trie.phonemes, words, word_offset, bytearray(b"".join(encoded_words)), pron_start,
+                   pron_offset, pron_phonemes, displacement, slot_word)
+
+    def lookup(self, word: str) -> int:
+        # word ID of word (ASCII case-insensitive), -1 if not in the dictionary
+        key = word.encode("utf-8")
+        word_hash = _word_hash(key)
+        d = self.displacement[word_hash % len(self.displacement)]
+        i = self.slot_word[_slot_hash(word_hash, d) % len(self.slot_word)]
+        if i == HASH_EMPTY or bytes(self.pool[self.word_offset[i]:self.word_offset[i + 1]]).upper() != key.upper():
+            return -1
+        return i
+
+    def word_pronunciations(self, i: int) -> List[Tuple[str,...]]:
+        return [tuple(self.phonemes[p] for p in self.pron_phonemes[self.pron_offset[k]:self.pron_offset[k + 1]])
+                for k in range(self.pron_start[i], self.pron_start[i + 1])]
+
+    def pronunciations(self, word: str) -> List[Tuple[str,...]]:
+        # all pronunciations of word in dictionary order, [] if it is unknown
+        i = self.lookup(word)
+        return self.word_pronunciations(i) if i >= 0 else []
+
+    def transcribe(self, text: bytes) -> List[Tuple[str, List[Tuple[str,...]]]]:
+        # (token, pronunciations) of every token of text, tokens as in most_freq_words.c
+        library = _load_native_library()
+        if library is None:
+            return [(token.decode("latin-1"), self.pronunciations(token.decode("latin-1")))
+                    for token in re.findall(rb"[A-Za-z][A-Za-z']*", text)]
+        buffer = (ctypes.c_uint8 * max(len(text), 1)).from_buffer_copy(text or b"\0")
+        max_tokens = len(text) // 2 + 1
+        bounds = (ctypes.c_int64 * (2 * max_tokens))()
+        word_ids = (ctypes.c_int32 * max_tokens)()
+        num_tokens = library.pronunciation_hash_lookup_tokens(ctypes.byref(self.native()), buffer, len(text),
+                                                              bounds, word_ids, max_tokens)
+        return [(text[bounds[2 * k]:bounds[2 * k + 1]].decode("latin-1"),
+                 self.word_pronunciations(word_ids[k]) if word_ids[k] >= 0 else [])
+                for k in range(num_tokens)]
+
+    def transcribe_file(self, path: str, out) -> None:
+        # write "token<TAB>P1 P2 ... | P1 P2 ..." lines for every token of the
+        # text file to the binary stream out, natively in one pass when built
+        with open(path, "rb") as f:
+            if os.fstat(f.fileno()).st_size == 0:
+                return
+            data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+        library = _load_native_library()
+        if library is None:
+            for token, pronunciations in self.transcribe(data[:]):
+                out.write(("%s\t%s\n" % (token, " | ".join(" ".join(p) for p in pronunciations))).encode("latin-1"))
+            data.close()
+            return
+
+        symbols = b"".join(phoneme.encode("ascii").ljust(COMPILED_PHONEME_SIZE, b"\0") for phoneme in self.phonemes)
+        text = (ctypes.c_uint8 * len(data)).from_buffer(data)
+        capacity = TRANSCRIBE_BUFFER_SIZE
+        buffer = ctypes.create_string_buffer(capacity)
+        consumed = ctypes.c_int64()
+        offset = 0
+        while offset < len(data):
+            written = library.pronunciation_hash_transcribe(
+                ctypes.byref(self.native()), symbols, len(self.phonemes), ctypes.addressof(text) + offset,
+                len(data) - offset, buffer, capacity, ctypes.byref(consumed))
+            out.write(memoryview(buffer)[:written])
+            offset += consumed.value
+            if written == 0 and consumed.value == 0:
+                capacity *= 2 # a single line longer than the buffer
+                buffer = ctypes.create_string_buffer(capacity)
+        del text
+        data.close()
+
+    def native(self) -> Optional["PronunciationHashStruct"]:
+        # ctypes view of the arrays, None if the native library is not built
+        if self._native is None and _load_native_library() is not None:
+            def pointer(values, ctype):
+                return (ctype * max(len(values), 1)).from_buffer(values) if len(values) else None
+            self._native = PronunciationHashStruct(
+                len(self.displacement), len(self.slot_word),
+                pointer(self.displacement, ctypes.c_uint32),
+                pointer(self.slot_word, ctypes.c_uint32),
+                pointer(self.word_offset, ctypes.c_uint32),
+                pointer(self.pool, ctypes.c_uint8),
+                pointer(self.pron_start, ctypes.c_uint32),
+                pointer(self.pron_offset, ctypes.c_uint32),
+                pointer(self.pron_phonemes, ctypes.c_uint8))
+        return self._native
 
+class PronunciationHashStruct(ctypes.Structure):
+    # must match PronunciationHash in phonemes_trie.c
+    _fields_ = [("num_buckets", ctypes.c_uint32),
+                ("num_slots", ctypes.c_uint32),
+                ("displacement", ctypes.POINTER(ctypes.c_uint32)),
+                ("slot_word", ctypes.POINTER(ctypes.c_uint32)),
+                ("word_offset", ctypes.POINTER(ctypes.c_uint32)),
+                ("pool", ctypes.POINTER(ctypes.c_uint8)),
+                ("pron_start", ctypes.POINTER(ctypes.c_uint32)),
+                ("pron_offset", ctypes.POINTER(ctypes.c_uint32)),
+                ("pron_phonemes", ctypes.POINTER(ctypes.c_uint8))]
+
+class PhonemeTrieStruct(ctypes.Structure):
+    # must match PhonemeTrie in phonemes_trie.c
+    _fields_ = [("num_nodes", ctypes.c_uint32),
+                ("edge_start", ctypes.POINTER(ctypes.c_uint32)),
+                ("edge_phoneme", ctypes.POINTER(ctypes.c_uint8)),
+                ("edge_child", ctypes.POINTER(ctypes.c_uint32)),
+                ("word_start", ctypes.POINTER(ctypes.c_uint32))]
+
+class PhonemeCostsStruct(ctypes.Structure):
+    # must match PhonemeCosts in phonemes_trie.c
+    _fields_ = [("substitution", ctypes.POINTER(ctypes.c_float)),
+                ("insertion", ctypes.POINTER(ctypes.c_float)),
+                ("deletion", ctypes.POINTER(ctypes.c_float))]
+
+_native_library = None
+
+def _load_native_library() -> Optional[ctypes.CDLL]:
+    # libphonemes_trie.so next to this file, None if it has not been built
+    global _native_library
+    if _native_library is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), NATIVE_LIBRARY)
+        try:
+            library = ctypes.CDLL(path)
+        except OSError:
+            _native_library = False
+            return None
+        library.phoneme_trie_find_matches.restype = ctypes.c_int32
+        library.phoneme_trie_find_matches.argtypes = [
+            ctypes.POINTER(PhonemeTrieStruct), ctypes.c_char_p, ctypes.c_int32,
+            ctypes.POINTER(ctypes.c_int32), ctypes.c_int32]
+        library.phoneme_trie_find_approximate_matches.restype = ctypes.c_int32
+        library.phoneme_trie_find_approximate_matches.argtypes = [
+            ctypes.POINTER(PhonemeTrieStruct), ctypes.c_char_p, ctypes.c_int32,
+            ctypes.POINTER(PhonemeCostsStruct), ctypes.c_double, ctypes.c_int32, ctypes.c_int32,
+            ctypes.POINTER(ctypes.c_int32), ctypes.POINTER(ctypes.c_double), ctypes.c_int32]
+        library.pronunciation_hash_lookup_tokens.restype = ctypes.c_int64
+        library.pronunciation_hash_lookup_tokens.argtypes = [
+            ctypes.POINTER(PronunciationHashStruct), ctypes.c_void_p, ctypes.c_int64,
+            ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int32), ctypes.c_int64]
+        library.pronunciation_hash_transcribe.restype = ctypes.c_int64
+        library.pronunciation_hash_transcribe.argtypes = [
+            ctypes.POINTER(PronunciationHashStruct), ctypes.c_char_p, ctypes.c_int32, ctypes.c_void_p,
+            ctypes.c_int64, ctypes.c_char_p, ctypes.c_int64, ctypes.POINTER(ctypes.c_int64)]
+        library.phoneme_trie_find_matches_batch.restype = None
+        library.phoneme_trie_find_matches_batch.argtypes = [
+            ctypes.POINTER(PhonemeTrieStruct), ctypes.c_char_p, ctypes.POINTER(ctypes.c_int64),
+            ctypes.c_int32, ctypes.c_int32, ctypes.POINTER(ctypes.c_int32), ctypes.POINTER(ctypes.c_int32)]
+        _native_library = library
+    return _native_library or None
+
+def find_word_matches(phonemes: Sequence[str],
+                      index: Optional["PronunciationIndex"] = None) -> List[Tuple[int, int, List[str]]]:
+    # all (start, end, words) such that phonemes[start:end] is pronounced as words,
+    # ordered by start then end
+    if index is None:
+        index = get_default_index()
+    n = len(phonemes)
+    library = _load_native_library()
+    trie = index.trie
+    if library is None:
+        # same walk as phonemes_trie.c
+        ids = trie.encode(phonemes)
+        matches = []
+        for start in range(n):
+            node = 0
+            for end in range(start, n):
+                if ids[end] == PHONEME_UNKNOWN:
+                    break
+                node = trie.child(node, ids[end])
+                if node == 0:
+                    break
+                if trie.word_start[node] != trie.word_start[node + 1]:
+                    matches.append((start, end + 1, trie.node_words(node)))
+        return matches
+
+    max_matches = n * index.max_length # at most one trie node per (start, end)
+    buffer = (ctypes.c_int32 * (3 * max(max_matches, 1)))()
+    num_matches = library.phoneme_trie_find_matches(ctypes.byref(trie.native()), trie.encode(phonemes),
+                                                    n, buffer, max_matches)
+    return [(buffer[3 * k], buffer[3 * k + 1], trie.node_words(buffer[3 * k + 2]))
+            for k in range(num_matches)]
+
+def _find_word_matches_chunk(sequences: Sequence[Sequence[str]],
+                             index: "PronunciationIndex") -> List[List[Tuple[int, int, List[str]]]]:
+    library = _load_native_library()
+    if library is None:
+        return [find_word_matches(phonemes, index) for phonemes in sequences]
+
+    trie = index.trie
+    max_length = max(index.max_length, 1)
+    offsets = (ctypes.c_int64 * (len(sequences) + 1))()
+    for s, phonemes in enumerate(sequences):
+        offsets[s + 1] = offsets[s] + len(phonemes)
+    encoded = b"".join(trie.encode(phonemes) for phonemes in sequences)
+    buffer = (ctypes.c_int32 * (3 * max(offsets[len(sequences)] * max_length, 1)))()
+    num_matches = (ctypes.c_int32 * max(len(sequences), 1))()
+    library.phoneme_trie_find_matches_batch(ctypes.byref(trie.native()), encoded, offsets, len(sequences),
+                                            max_length, buffer, num_matches)
+
+    results = []
+    for s in range(len(sequences)):
+        base = 3 * offsets[s] * max_length
+        results.append([(buffer[base + 3 * k], buffer[base + 3 * k + 1], trie.node_words(buffer[base + 3 * k + 2]))
+                        for k in range(num_matches[s])])
+    return results
+
+def find_word_matches_batch(sequences: Sequence[Sequence[str]], index: Optional["PronunciationIndex"] = None,
+                            workers: Optional[int] = None) -> List[List[Tuple[int, int, List[str]]]]:
+    # find_word_matches() of every sequence, in order, chunks matched in parallel
+    if index is None:
+        index = get_default_index()
+    index.trie.native() # build shared state before the workers start
+
+    chunks = []
+    chunk, chunk_phonemes = [], 0
+    for phonemes in sequences:
+        chunk.append(phonemes)
+        chunk_phonemes += len(phonemes)
+        if chunk_phonemes >= BATCH_CHUNK_PHONEMES:
+            chunks.append(chunk)
+            chunk, chunk_phonemes = [], 0
+    if chunk:
+        chunks.append(chunk)
+
+    with ThreadPoolExecutor(max_workers=workers or os.cpu_count()) as pool:
+        return [matches for chunk_matches in pool.map(_find_word_matches_chunk, chunks, [index] * len(chunks))
+                for matches in chunk_matches]
+
+##################################################################################
+# APPROXIMATE MATCHING
+##################################################################################
+class PhonemeErrorModel:
+    # costs of recognizer errors and search limits for approximate matching
+    # substitution[(expected, heard)]: dictionary phoneme expected, input has heard
+    # insertion[heard]: extra phoneme in the input
+    # deletion[expected]: dictionary phoneme missing from the input
+    # phonemes without an entry use the default costs, which must be positive
+    # heard phonemes the dictionary does not know are all encoded as
+    # PHONEME_UNKNOWN, their costs apply to that ID and must agree (ValueError
+    # otherwise). Costs of expected phonemes not in the dictionary can never
+    # apply and are ignored
+
+    def __init__(self, max_cost: float = 1.0, beam_width: int = 64,
+                 substitution: Optional[Dict[Tuple[str, str], float]] = None,
+                 insertion: Optional[Dict[str, float]] = None,
+                 deletion: Optional[Dict[str, float]] = None,
+                 default_substitution: float = 1.0, default_insertion: float = 1.0,
+                 default_deletion: float = 1.0):
+        self.max_cost = max_cost
+        self.beam_width = beam_width
+        self.substitution = substitution or {}
+        self.insertion = insertion or {}
+        self.deletion = deletion or {}
+        self.default_substitution = default_substitution
+        self.default_insertion = default_insertion
+        self.default_deletion = default_deletion
+        self._tables = {}
+
+    def max_span(self, max_length: int) -> int:
+        # longest input segment a match can cover
+        min_insertion = min([self.default_insertion] + list(self.insertion.values()))
+        return max_length + int(self.max_cost / min_insertion)
+
+    def tables(self, trie: "PhonemeTrie") -> Tuple[array, array, array]:
+        # (substitution, insertion, deletion) cost arrays indexed by the trie's
+        # phoneme IDs, substitution[expected * PHONEME_IDS + heard]
+        key = id(trie)
+        if key not in self._tables:
+            substitution = array("f", [self.default_substitution]) * (PHONEME_IDS * PHONEME_IDS)
+            insertion = array("f", [self.default_insertion]) * PHONEME_IDS
+            deletion = array("f", [self.default_deletion]) * PHONEME_IDS
+            unknown = {} # cost table position of an unknown heard phoneme -> (phoneme, cost)
+
+            def set_heard(table, position, heard, cost):
+                if heard not in trie.phoneme_ids:
+                    if position in unknown and unknown[position][1] != cost:
+                        raise ValueError("phonemes %s and %s are not in the dictionary, both are heard as "
+                                         "PHONEME_UNKNOWN but have different costs" % (unknown[position][0], heard))
+                    unknown[position] = (heard, cost)
+                table[position] = cost
+
+            for (expected, heard), cost in self.substitution.items():
+                if expected in trie.phoneme_ids:
+                    heard_id = trie.phoneme_ids.get(heard, PHONEME_UNKNOWN)
+                    set_heard(substitution, trie.phoneme_ids[expected] * PHONEME_IDS + heard_id, heard, cost)
+            for heard, cost in self.insertion.items():
+                set_heard(insertion, trie.phoneme_ids.get(heard, PHONEME_UNKNOWN), heard, cost)
+            for expected, cost in self.deletion.items():
+                if expected in trie.phoneme_ids:
+                    deletion[trie.phoneme_ids[expected]] = cost
+            self._tables[key] = (trie, substitution, insertion, deletion)
+        return self._tables[key][1:]
+
+def find_approximate_word_matches(phonemes: Sequence[str], errors: PhonemeErrorModel,
+                                  index: Optional["PronunciationIndex"] = None
+                                  ) -> List[Tuple[int, int, List[str], float]]:
+    # all (start, end, words, cost) such that phonemes[start:end] is pronounced as
+    # words with edits costing at most errors.max_cost, ordered by start then end
+    if index is None:
+        index = get_default_index()
+    trie = index.trie
     n = len(phonemes)
-    results = [[] for _ in range(n+1)]
-    results[0] = [[]] # base case: 0 phonemes gives empty word combinations
+    ids = trie.encode(phonemes)
+    max_span = errors.max_span(index.max_length)
+    substitution, insertion, deletion = errors.tables(trie)
+
+    best = {} # (start, end, node) -> lowest cost, a node may be reached twice in a DAWG
+    library = _load_native_library()
+    if library is not None:
+        costs = PhonemeCostsStruct((ctypes.c_float * len(substitution)).from_buffer(substitution),
+                                   (ctypes.c_float * len(insertion)).from_buffer(insertion),
+                                   (ctypes.c_float * len(deletion)).from_buffer(deletion))
+        max_matches = 0
+        while True:
+            buffer = (ctypes.c_int32 * (3 * max(max_matches, 1)))()
+            match_costs = (ctypes.c_double * max(max_matches, 1))()
+            num_matches = library.phoneme_trie_find_approximate_matches(
+                ctypes.byref(trie.native()), ids, n, ctypes.byref(costs), errors.max_cost, max_span,
+                errors.beam_width, buffer, match_costs, max_matches)
+            if num_matches < 0:
+                raise MemoryError("approximate matching workspace")
+            if num_matches <= max_matches:
+                break
+            max_matches = num_matches # buffer too small, search again
+        for k in range(num_matches):
+            key = (buffer[3 * k], buffer[3 * k + 1], buffer[3 * k + 2])
+            best[key] = min(best.get(key, math.inf), match_costs[k])
+    else:
+        # same beam search as phonemes_trie.c, float costs summed in double
+        for start in range(n):
+            span = min(n - start, max_span)
+            row = [0.0] * (span + 1)
+            for i in range(1, span + 1):
+                row[i] = row[i - 1] + insertion[ids[start + i - 1]]
+            level = [(0, row)]
+            while level:
+                next_level = []
+                for node, row in level:
+                    for e in range(trie.edge_start[node], trie.edge_start[node + 1]):
+                        expected = trie.edge_phoneme[e]
+                        child_row = [row[0] + deletion[expected]]
+                        for i in range(1, span + 1):
+                            heard = ids[start + i - 1]
+                            child_row.append(min(
+                                row[i - 1] + (0.0 if heard == expected else substitution[expected * PHONEME_IDS + heard]),
+                                row[i] + deletion[expected],
+                                child_row[i - 1] + insertion[heard]))
+                        row_min = min(child_row)
+                        if row_min > errors.max_cost:
+                            continue
+                        child = trie.edge_child[e]
+                        if trie.word_start[child] != trie.word_start[child + 1]:
+                            for i in range(1, span + 1):
+                                if child_row[i] <= errors.max_cost:
+                                    key = (start, start + i, child)
+                                    best[key] = min(best.get(key, math.inf), child_row[i])
+                        next_level.append((row_min, child, len(next_level), child_row))
+                # ties broken by node ID then generation order, best first
+                next_level = heapq.nsmallest(errors.beam_width, next_level, key=lambda state: state[:3])
+                level = [(node, row) for _, node, _, row in next_level]
+
+    return [(start, end, trie.node_words(node), cost) for (start, end, node), cost in sorted(best.items())]
+
+def build_approximate_word_lattice(phonemes: Sequence[str], errors: PhonemeErrorModel,
+                                   index: Optional["PronunciationIndex"] = None,
+                                   skip_costs: Optional[List[float]] = None) -> "WordLattice":
+    return _lattice_from_matches(len(phonemes), find_approximate_word_matches(phonemes, errors, index), skip_costs)
+
+##################################################################################
+# WORD LATTICE
+##################################################################################
+class WordLattice:
+    # DAG of word matches over phoneme positions 0..n
+    # edges: (start, end, word), word is None for an edge skipping an unmatched phoneme
+    # costs: edit cost of each edge for approximate matches, None if all are exact
+    # explicit_skips: skip edges are at every position and their cost is the skip
+    #                 penalty, otherwise only where no word ends
+    # edges_by_end[i]: (start, word) of the edges ending at position i
+    # costs_by_end[i]: their edit costs
+
+    def __init__(self, n: int, edges: List[Tuple[int, int, Optional[str]]],
+                 costs: Optional[List[float]] = None, explicit_skips: bool = False):
+        self.n = n
+        self.edges = edges
+        self.costs = costs
+        self.explicit_skips = explicit_skips
+        self.edges_by_end = [[] for _ in range(n+1)]
+        self.costs_by_end = [[] for _ in range(n+1)]
+        for k, (start, end, word) in enumerate(edges):
+            self.edges_by_end[end].append((start, word))
+            self.costs_by_end[end].append(costs[k] if costs is not None else 0.0)
+
+        # paths[i] = number of paths from 0 to i
+        self.paths = [0] * (n+1)
+        self.paths[0] = 1
+        for i in range(1, n+1):
+            self.paths[i] = sum(self.paths[start] for start, _ in self.edges_by_end[i])
+
+    def count_segmentations(self) -> int:
+        return self.paths[self.n]
+
+    def __iter__(self) -> Iterator[List[str]]:
+        # depth first search back from n, the edge nearest position 0 varies fastest
+        if self.paths[self.n] == 0:
+            return
+        stack = [(self.n, 0)] # (position, index of next edge in edges_by_end[position])
+        path = []             # words of the edges on the stack, last word first
+        while stack:
+            position, k = stack[-1]
+            if position == 0:
+                yield [word for word in reversed(path) if word is not None]
+                stack.pop()
+                if path:
+                    path.pop()
+                continue
+            edges = self.edges_by_end[position]
+            while k < len(edges) and self.paths[edges[k][0]] == 0:
+                k += 1 # dead end, no path from 0
+            if k == len(edges):
+                stack.pop()
+                if path:
+                    path.pop()
+                continue
+            stack[-1] = (position, k + 1)
+            start, word = edges[k]
+            stack.append((start, 0))
+            path.append(word)
+
+##################################################################################
+# K-BEST SEGMENTATIONS
+##################################################################################
+class UnigramModel:
+    # word costs -log P(word) from word counts, P(word) = (count + 1) / (total + V + 1)
+    # V = number of counted words, the extra 1 reserves mass for unseen words
+
+    def __init__(self, counts: Dict[str, int]):
+        self.counts = {word.upper(): count for word, count in counts.items()}
+        self.log_total = math.log(sum(self.counts.values()) + len(self.counts) + 1)
 
-    for i in range(1,n+1): # iterate through phoneme sequence one sound at a time
-        for j in range (i): # look back to see if any previous segment of sequence matches
-            phoneme_segment = tuple(phonemes[j:i])
-            if phoneme_segment in phoneme_to_words:
-                words = phoneme_to_words[phoneme_segment]
-                for word in words:
-                    for prev_word_combo in results[j]:
-                        # concatenate prev word combos with new next word
-                        results[i].append(prev_word_combo + [word])
+    @classmethod
+    def load(cls, path: str) -> "UnigramModel":
+        # lines of "word count", optionally prefixed by "rank:" as printed by
+        # most_freq_words --counts
+        counts = {}
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                if fields and fields[0].endswith(":"):
+                    fields = fields[1:]
+                if len(fields) >= 2 and fields[1].isdigit():
+                    counts[fields[0]] = counts.get(fields[0], 0) + int(fields[1])
+        return cls(counts)
 
-        # if no results found for up to ith phoneme, set current result = to prev result
-        if results[i] == []:
-            results[i] = results[i-1]
-            # this is to ensure unmatched phonemes are ignored
+    def cost(self, word: Optional[str]) -> float:
+        # skipped phonemes cost as much as an unseen word
+        count = self.counts.get(word.upper(), 0) if word is not None else 0
+        return self.log_total - math.log(count + 1)
 
-    
-    # result is stored at last non empty index in results array
-    return results[n]
+    def skip_cost(self, phoneme: str, skip_penalty: SkipPenalty = None) -> float:
+        # cost of skipping phoneme, see SkipPenalty
+        # an empty model has free unseen words, skips still cost 1 there
+        if skip_penalty is None:
+            return max(self.cost(None), 1.0)
+        if isinstance(skip_penalty, Mapping):
+            return skip_penalty.get(phoneme, self.cost(None))
+        return float(skip_penalty)
+
+def find_k_best_segmentations(phonemes: Sequence[str], k: int, unigram: Optional[UnigramModel] = None,
+                              index: Optional["PronunciationIndex"] = None,
+                              errors: Optional["PhonemeErrorModel"] = None,
+                              skip_penalty: SkipPenalty = None) -> List[Tuple[float, List[str]]]:
+    # k lowest cost (cost, words) segmentations, best first
+    # without a unigram model words cost nothing, only skipped phonemes are paid for
+    # with an error model words are matched approximately, see PhonemeErrorModel
+    # any phoneme may be skipped at the cost of skip_penalty
+    if unigram is None:
+        unigram = UnigramModel({})
+    skip_costs = [unigram.skip_cost(phoneme, skip_penalty) for phoneme in phonemes]
+    if errors is None:
+        lattice = _lattice_from_matches(len(phonemes), find_word_matches(phonemes, index), skip_costs)
+    else:
+        lattice = build_approximate_word_lattice(phonemes, errors, index, skip_costs)
+    return k_best_lattice_paths(lattice, k, unigram)
+
+def k_best_lattice_paths(lattice: "WordLattice", k: int,
+                         unigram: Optional[UnigramModel] = None) -> List[Tuple[float, List[str]]]:
+    # k lowest cost (cost, words) paths from 0 to n, cost = unigram cost + edit cost,
+    # explicit skip edges cost their skip penalty only
+    if unigram is None:
+        unigram = UnigramModel({})
+    n = lattice.n
+    incoming = lattice.edges_by_end
+    edge_cost = [[(0.0 if word is None and lattice.explicit_skips else unigram.cost(word)) + cost
+                  for (_, word), cost in zip(incoming[v], lattice.costs_by_end[v])]
+                 for v in range(n+1)]
+
+    # kbest[v][r] = (cost, edge index in incoming[v], rank of path at the edge start)
+    kbest = [[] for _ in range(n+1)]
+    kbest[0].append((0.0, -1, -1))
+    for v in range(1, n+1): # Viterbi
+        candidates = [(kbest[start][0][0] + edge_cost[v][e], e, 0)
+                      for e, (start, _) in enumerate(incoming[v]) if kbest[start]]
+        if candidates:
+            kbest[v].append(min(candidates))
+
+    heaps = [None] * (n+1)                 # candidates for the next path at v
+    successor_pending = [bool(paths) for paths in kbest] # next of last path not in heap yet
+    exhausted = [False] * (n+1)
+    exhausted[0] = True
+    successor_pending[0] = False
+
+    def extend(target: int, rank: int):
+        # compute kbest[target][rank] if it exists, iteratively since a path may
+        # need the next path of its predecessor first
+        stack = [(target, rank)]
+        while stack:
+            v, r = stack[-1]
+            if len(kbest[v]) > r or exhausted[v]:
+                stack.pop()
+                continue
+            if heaps[v] is None:
+                best_edge = kbest[v][0][1]
+                heaps[v] = [(kbest[start][0][0] + edge_cost[v][e], e, 0)
+                            for e, (start, _) in enumerate(incoming[v]) if kbest[start] and e != best_edge]
+                heapq.heapify(heaps[v])
+            if successor_pending[v]:
+                _, e, j = kbest[v][-1]
+                start = incoming[v][e][0]
+                if len(kbest[start]) <= j + 1 and not exhausted[start]:
+                    stack.append((start, j + 1))
+                    continue
+                if len(kbest[start]) > j + 1:
+                    heapq.heappush(heaps[v], (kbest[start][j + 1][0] + edge_cost[v][e], e, j + 1))
+                successor_pending[v] = False
+            if heaps[v]:
+                kbest[v].append(heapq.heappop(heaps[v]))
+                successor_pending[v] = True
+            else:
+                exhausted[v] = True
+            stack.pop()
+
+    # paths through different spans can spell the same words (e.g. approximate
+    # matches of one word with and without an inserted phoneme), keep the cheapest
+    results = []
+    seen = set()
+    r = 0
+    while len(results) < k:
+        extend(n, r)
+        if len(kbest[n]) <= r:
+            break
+        words = []
+        v, rank = n, r
+        while v > 0:
+            _, e, j = kbest[v][rank]
+            start, word = incoming[v][e]
+            if word is not None:
+                words.append(word)
+            v, rank = start, j
+        words = tuple(words[::-1])
+        if words not in seen:
+            seen.add(words)
+            results.append((kbest[n][r][0], list(words)))
+        r += 1
+    return results
+
+def build_word_lattice(phonemes: Sequence[str], index: Optional["PronunciationIndex"] = None) -> WordLattice:
+    return _lattice_from_matches(len(phonemes), find_word_matches(phonemes, index))
+
+def build_word_lattices(sequences: Sequence[Sequence[str]], index: Optional["PronunciationIndex"] = None,
+                        workers: Optional[int] = None) -> List[WordLattice]:
+    # build_word_lattice() of every sequence, in order
+    return [_lattice_from_matches(len(phonemes), matches)
+            for phonemes, matches in zip(sequences, find_word_matches_batch(sequences, index, workers))]
+
+def _lattice_from_matches(n: int, matches: Sequence[Tuple],
+                          skip_costs: Optional[List[float]] = None) -> WordLattice:
+    # matches are (start, end, words) or, when approximate, (start, end, words, cost)
+    # skip_costs[i]: penalty of an explicit skip edge over phoneme i at every position,
+    # None to only skip where no word ends
+    edges = []
+    costs = []
+    has_word_ending = [False] * (n+1)
+    for match in matches:
+        start, end, words = match[:3]
+        has_word_ending[end] = True
+        edges.extend((start, end, word) for word in words)
+        costs.extend([match[3] if len(match) > 3 else 0.0] * len(words))
+
+    if skip_costs is not None:
+        edges.extend((i-1, i, None) for i in range(1, n+1))
+        costs.extend(skip_costs)
+        return WordLattice(n, edges, costs, explicit_skips=True)
+
+    # unmatched phonemes are ignored: skip phoneme i-1 if no word ends at i
+    skipped = [(i-1, i, None) for i in range(1, n+1) if not has_word_ending[i]]
+    edges.extend(skipped)
+    costs.extend([0.0] * len(skipped))
+    return WordLattice(n, edges, costs if any(costs) else None)
+
+##################################################################################
+# STREAMING SEGMENTATION
+##################################################################################
+class _Hypothesis:
+    # best segmentation of phonemes[0:position], linked back to the previous word
+    # children: live hypotheses extending this one, kept: still in best
+    __slots__ = ("position", "cost", "word", "previous", "children", "kept")
+
+    def __init__(self, position: int, cost: float, word: Optional[str], previous: Optional["_Hypothesis"]):
+        self.position = position
+        self.cost = cost
+        self.word = word
+        self.previous = previous
+        self.children = []
+        self.kept = True
+
+class StreamingSegmenter:
+    # incremental best segmentation, same costs as find_k_best_segmentations(k=1)
+    # with the same skip_penalty, as long as paths converge within max_delay
+    # phonemes (None: never forced)
+    # push() each phoneme as it arrives, it returns the words that became final
+    # partial() is the current best guess for the words that are not final yet
+    # finish() ends the stream and returns the remaining words
+
+    def __init__(self, index: Optional[PronunciationIndex] = None, unigram: Optional[UnigramModel] = None,
+                 skip_penalty: SkipPenalty = None, max_delay: Optional[int] = STREAMING_MAX_DELAY):
+        self.index = index if index is not None else get_default_index()
+        self.trie = self.index.trie
+        self.unigram = unigram if unigram is not None else UnigramModel({})
+        self.skip_penalty = skip_penalty
+        self.max_delay = max_delay
+        self.position = 0
+        self.active = []            # (start, node) of walks that can still match
+        self.best = {0: _Hypothesis(0, 0.0, None, None)} # position -> best hypothesis
+        self.final = self.best[0]   # end of the words already returned
+
+    def push(self, phoneme: str) -> List[str]:
+        trie = self.trie
+        phoneme_id = trie.phoneme_ids.get(phoneme, PHONEME_UNKNOWN)
+        start = self.position
+        end = self.position = start + 1
+
+        # skipping the phoneme competes with the words ending here
+        best_previous = self.best[start]
+        best_cost = best_previous.cost + self.unigram.skip_cost(phoneme, self.skip_penalty)
+        best_word = None
+        active = []
+        for start, node in self.active + [(start, 0)]:
+            node = trie.child(node, phoneme_id)
+            if node == 0:
+                continue
+            active.append((start, node))
+            if trie.word_start[node] != trie.word_start[node + 1]:
+                previous = self.best[start]
+                for word in trie.node_words(node):
+                    cost = previous.cost + self.unigram.cost(word)
+                    if cost < best_cost:
+                        best_previous, best_cost, best_word = previous, cost, word
+        best = _Hypothesis(end, best_cost, best_word, best_previous)
+        best_previous.children.append(best)
+        self.active = active
+        self.best[end] = best
+
+        # words can only start at the current position or at an active walk
+        oldest = min([start for start, _ in active] + [end])
+        for position in [position for position in self.best if position < oldest]:
+            self._release(self.best.pop(position))
+
+        words = self._finalize()
+        if self.max_delay is not None:
+            while end - self.final.position > self.max_delay:
+                words += self._force()
+        return words
+
+    def _release(self, hypothesis: "_Hypothesis") -> None:
+        # hypothesis left best, drop it and any ancestors nothing extends any more
+        hypothesis.kept = False
+        while hypothesis is not self.final and not hypothesis.kept and not hypothesis.children:
+            previous = hypothesis.previous
+            previous.children.remove(hypothesis)
+            hypothesis = previous
+
+    def _finalize(self) -> List[str]:
+        # every kept hypothesis extends the final point, move it forward while
+        # only one child does, the words passed are final
+        words = []
+        final = self.final
+        while not final.kept and len(final.children) == 1:
+            final = final.children[0]
+            final.previous = None # release the returned chain
+            if final.word is not None:
+                words.append(final.word)
+        self.final = final
+        return words
+
+    def _force(self) -> List[str]:
+        # make the next step of the current best path final, drop the
+        # hypotheses that do not extend it and the walks starting at them
+        step = self.best[self.position]
+        while step.previous is not self.final:
+            step = step.previous
+        for child in self.final.children:
+            if child is not step:
+                self._drop(child)
+        self.final.children = [step]
+        if self.final.kept:
+            self.final.kept = False
+            del self.best[self.final.position]
+        self.active = [(start, node) for start, node in self.active if start in self.best]
+        return self._finalize()
+
+    def _drop(self, hypothesis: "_Hypothesis") -> None:
+        # remove hypothesis and everything extending it
+        stack = [hypothesis]
+        while stack:
+            hypothesis = stack.pop()
+            if hypothesis.kept:
+                hypothesis.kept = False
+                del self.best[hypothesis.position]
+            stack.extend(hypothesis.children)
+            hypothesis.children = []
+
+    def pending(self) -> int:
+        # hypotheses kept after the final words, bounded when max_delay is set
+        count = 0
+        stack = list(self.final.children)
+        while stack:
+            hypothesis = stack.pop()
+            count += 1
+            stack.extend(hypothesis.children)
+        return count
+
+    def partial(self) -> List[str]:
+        # words after the final ones on the best path to the current position
+        words = []
+        hypothesis = self.best[self.position]
+        while hypothesis is not self.final:
+            if hypothesis.word is not None:
+                words.append(hypothesis.word)
+            hypothesis = hypothesis.previous
+        return words[::-1]
+
+    def cost(self) -> float:
+        # cost of the best segmentation of everything pushed so far
+        return self.best[self.position].cost
+
+    def finish(self) -> List[str]:
+        words = self.partial()
+        self.final = self.best[self.position]
+        self.final.previous = None
+        self.final.children = []
+        self.best = {self.position: self.final}
+        self.active = []
+        return words
+
+_default_index: Optional[PronunciationIndex] = None
+
+def get_default_index() -> PronunciationIndex:
+    # index of PRONUNCIATION_DICT, built on first use
+    global _default_index
+    if _default_index is None:
+        _default_index = PronunciationIndex.from_dictionary()
+    return _default_index
+
+##################################################################################
+# SOLUTION
+##################################################################################
+def find_word_combos_with_pronunciation(phonemes: Sequence[str],
+                                        index: Optional[PronunciationIndex] = None) -> Sequence[Sequence[str]]:
+    # combinations are read from the word lattice, see build_word_lattice()
+    # to count or iterate over them without storing all of them
+    return list(build_word_lattice(phonemes, index))
 
 ##################################################################################
 # MAIN FUNCTION
 ##################################################################################
 def main():
+    # python phonemes_sequence.py --compile <dictionary.txt> <compiled.bin>
+    if len(sys.argv) == 4 and sys.argv[1] == "--compile":
+        compile_dictionary_text(sys.argv[2], sys.argv[3])
+        return
+
+    # python phonemes_sequence.py --transcribe <compiled.bin> <text file>
+    if len(sys.argv) == 4 and sys.argv[1] == "--transcribe":
+        PronunciationIndex.load_compiled(sys.argv[2]).reverse.transcribe_file(sys.argv[3], sys.stdout.buffer)
+        return
+
     # Test code with example phoneme sequence provided
     phonemes = ["DH", "EH", "R", "DH", "EH", "R"]
     result = find_word_combos_with_pronunciation(phonemes)
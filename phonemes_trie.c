@@ -0,0 +1,598 @@
+/* Filename: phonemes_trie.c
+ * Author: Gary Atwal
+ * Project: Picovoice Screening Questions
+ *
+ * Description:
+ * Native segmentation engine for phonemes_sequence.py, loaded with ctypes.
+ * Finds every dictionary pronunciation that occurs in a phoneme sequence.
+ *
+ * Solution:
+ * 1) Phonemes are interned to uint8 IDs by phonemes_sequence.py (~40 symbols),
+ *    PHONEME_UNKNOWN marks input phonemes that are not in the dictionary
+ * 2) Pronunciations are stored in a trie of flat arrays (compressed sparse rows)
+ *    built by phonemes_sequence.py:
+ *    i) children of node v are edges edge_start[v] .. edge_start[v+1]-1,
+ *       sorted by phoneme ID so a child is found with binary search
+ *   ii) node v ends a pronunciation if word_start[v] != word_start[v+1], the
+ *       words themselves are resolved in Python from the node ID
+ * 3) From each start position walk the trie forward one phoneme at a time until
+ *    there is no child, reporting every terminal node as a (start, end, node)
+ *    match. This is O(n * max pronunciation length) with no allocation, and a
+ *    (start, end) pair has at most one node so n * max length bounds the output
+ * 4) Batches of sequences are matched in one call on a flat array of phoneme
+ *    IDs with sequence offsets. The trie is read-only and the call holds no
+ *    Python state, so phonemes_sequence.py runs one batch call per chunk from
+ *    a thread pool and ctypes releases the GIL while each call runs
+ * 5) Approximate matching for recognizer errors walks the trie breadth first
+ *    from each start position carrying an edit distance row per trie node:
+ *    row[i] = cheapest alignment of the node's pronunciation prefix with the
+ *    next i input phonemes, using per-phoneme substitution (dictionary phoneme
+ *    heard as another), insertion (extra input phoneme) and deletion (missing
+ *    dictionary phoneme) costs
+ *    i) nodes whose whole row exceeds max_cost are not expanded
+ *   ii) beam pruning keeps only the beam_width nodes with the lowest row
+ *       minimum at each depth, in a max-heap, so work per start position is
+ *       bounded by max length * beam_width * children. Ties are broken by
+ *       trie node ID, then by the order the candidates were generated in, and
+ *       each depth is expanded in that order, so the kept nodes match the
+ *       Python fallback in phonemes_sequence.py exactly
+ *  iii) terminal nodes report (start, start + i, node, row[i]) for every
+ *       row[i] <= max_cost. Costs are given as floats, rows are summed and
+ *       compared with max_cost in double like the Python fallback, so both
+ *       return the same matches and costs, also at the max_cost boundary
+ * 6) Text is converted to phonemes with a word -> pronunciations index built by
+ *    phonemes_sequence.py, stored next to the trie in the compiled dictionary:
+ *    i) words are found with a hash-and-displace perfect hash: a 64-bit FNV-1a
+ *       hash h of the upper-cased word picks bucket h % num_buckets, whose
+ *       displacement d was chosen at build time so that all words of the
+ *       bucket land in distinct free slots mix(h, d) % num_slots. A lookup is
+ *       one hash, two array reads and one string compare (words that are not
+ *       in the dictionary land on some slot and fail the compare)
+ *   ii) pronunciations of word w are pron_start[w] .. pron_start[w+1]-1, each
+ *       a run of phoneme IDs in pron_phonemes
+ *  iii) tokens are split like most_freq_words.c (a letter followed by letters
+ *       and apostrophes) in one pass over the text, so a token stream is
+ *       converted without allocation or copies
+ *   iv) a large dictionary does not fit in cache and every lookup is a chain
+ *       of dependent loads, so tokens are looked up LOOKUP_BATCH at a time and
+ *       each load of the chain is prefetched for the whole batch first
+ *
+ * Build:
+ * gcc -O2 -shared -fPIC phonemes_trie.c -o libphonemes_trie.so
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PHONEME_UNKNOWN 255
+#define PHONEME_IDS 256
+#define PHONEME_SYMBOL_SIZE 8     // NUL padded symbols, as in the compiled dictionary
+#define HASH_EMPTY 0xFFFFFFFFu    // free perfect hash slot
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define LOOKUP_BATCH 16           // tokens whose hash lookups overlap
+
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)0)
+#endif
+
+/*******************************************************************************
+ * TRIE DEFINITION
+ *******************************************************************************/
+/* Layout must match PhonemeTrieStruct in phonemes_sequence.py */
+typedef struct PhonemeTrie {
+    uint32_t num_nodes;
+    const uint32_t *edge_start;   // [num_nodes + 1]
+    const uint8_t *edge_phoneme;  // [num_edges]
+    const uint32_t *edge_child;   // [num_edges]
+    const uint32_t *word_start;   // [num_nodes + 1]
+} PhonemeTrie;
+
+/* Child of node along phoneme, or 0 (the root, never a child) if none */
+static uint32_t trie_child(const PhonemeTrie *trie, uint32_t node, uint8_t phoneme){
+    uint32_t lo = trie->edge_start[node];
+    uint32_t hi = trie->edge_start[node + 1];
+    while (lo < hi){
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (trie->edge_phoneme[mid] < phoneme){
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < trie->edge_start[node + 1] && trie->edge_phoneme[lo] == phoneme){
+        return trie->edge_child[lo];
+    }
+    return 0;
+}
+
+static int trie_is_terminal(const PhonemeTrie *trie, uint32_t node){
+    return trie->word_start[node] != trie->word_start[node + 1];
+}
+
+/*******************************************************************************
+ * SOLUTION
+ *******************************************************************************/
+/* Find all pronunciations in phonemes[0, n)
+   matches receives (start, end, node) triples, room for max_matches triples
+   Returns the number of matches found, which may exceed max_matches */
+int32_t phoneme_trie_find_matches(const PhonemeTrie *trie, const uint8_t *phonemes, int32_t n,
+                                  int32_t *matches, int32_t max_matches){
+    int32_t num_matches = 0;
+    for (int32_t start = 0; start < n; start++){
+        uint32_t node = 0;
+        for (int32_t end = start; end < n; end++){
+            if (phonemes[end] == PHONEME_UNKNOWN){
+                break;
+            }
+            node = trie_child(trie, node, phonemes[end]);
+            if (node == 0){
+                break; // no pronunciation continues with this phoneme
+            }
+            if (trie_is_terminal(trie, node)){
+                if (num_matches < max_matches){
+                    matches[3 * num_matches] = start;
+                    matches[3 * num_matches + 1] = end + 1;
+                    matches[3 * num_matches + 2] = (int32_t)node;
+                }
+                num_matches++;
+            }
+        }
+    }
+    return num_matches;
+}
+
+/* Find all pronunciations in each sequence of a batch
+   sequence s is phonemes[offsets[s], offsets[s+1]), its matches are written as
+   (start, end, node) triples starting at matches + 3 * offsets[s] * max_length
+   and their number to num_matches[s]. max_length is the longest pronunciation,
+   which bounds the number of matches of a sequence to its length * max_length */
+void phoneme_trie_find_matches_batch(const PhonemeTrie *trie, const uint8_t *phonemes, const int64_t *offsets,
+                                     int32_t num_sequences, int32_t max_length,
+                                     int32_t *matches, int32_t *num_matches){
+    for (int32_t s = 0; s < num_sequences; s++){
+        int32_t n = (int32_t)(offsets[s + 1] - offsets[s]);
+        num_matches[s] = phoneme_trie_find_matches(trie, phonemes + offsets[s], n,
+                                                   matches + 3 * offsets[s] * max_length, n * max_length);
+    }
+}
+
+/*******************************************************************************
+ * APPROXIMATE MATCHING
+ *******************************************************************************/
+/* Edit costs, indexed by phoneme ID, must match PhonemeCostsStruct in
+   phonemes_sequence.py */
+typedef struct PhonemeCosts {
+    const float *substitution; // [PHONEME_IDS * PHONEME_IDS], [dictionary][input]
+    const float *insertion;    // [PHONEME_IDS], extra input phoneme
+    const float *deletion;     // [PHONEME_IDS], missing dictionary phoneme
+} PhonemeCosts;
+
+/* Trie nodes of one depth of the beam search, rows are max_span + 1 doubles */
+typedef struct BeamLevel {
+    int32_t size;
+    uint32_t *node;
+    double *row_min;
+    int32_t *order; // candidates of the depth generated before this one
+    double *rows;
+    int32_t *heap;  // max-heap of slots by (row_min, node, order)
+} BeamLevel;
+
+/* Slot a is a worse candidate than slot b */
+static int beam_worse(const BeamLevel *level, int32_t a, int32_t b){
+    if (level->row_min[a] != level->row_min[b]){
+        return level->row_min[a] > level->row_min[b];
+    }
+    if (level->node[a] != level->node[b]){
+        return level->node[a] > level->node[b];
+    }
+    return level->order[a] > level->order[b];
+}
+
+static void beam_heap_sift_down(BeamLevel *level, int32_t size, int32_t i){
+    while (1){
+        int32_t largest = i;
+        int32_t left = 2 * i + 1;
+        int32_t right = left + 1;
+        if (left < size && beam_worse(level, level->heap[left], level->heap[largest])){
+            largest = left;
+        }
+        if (right < size && beam_worse(level, level->heap[right], level->heap[largest])){
+            largest = right;
+        }
+        if (largest == i){
+            return;
+        }
+        int32_t tmp = level->heap[i];
+        level->heap[i] = level->heap[largest];
+        level->heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+static void beam_heap_sift_up(BeamLevel *level, int32_t i){
+    while (i > 0){
+        int32_t parent = (i - 1) / 2;
+        if (!beam_worse(level, level->heap[i], level->heap[parent])){
+            return;
+        }
+        int32_t tmp = level->heap[i];
+        level->heap[i] = level->heap[parent];
+        level->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Slot for the order-th candidate of a depth, node with the given row minimum,
+   -1 if the beam is full of better nodes (the worst node is evicted otherwise).
+   Candidates come in increasing order so a tie with the worst node loses */
+static int32_t beam_slot(BeamLevel *level, int32_t beam_width, double row_min, uint32_t node, int32_t order){
+    int32_t slot;
+    if (level->size < beam_width){
+        slot = level->size;
+        level->heap[level->size] = slot;
+        level->row_min[slot] = row_min;
+        level->node[slot] = node;
+        level->order[slot] = order;
+        level->size++;
+        beam_heap_sift_up(level, level->size - 1);
+        return slot;
+    }
+    slot = level->heap[0];
+    if (row_min > level->row_min[slot] || (row_min == level->row_min[slot] && node >= level->node[slot])){
+        return -1;
+    }
+    level->row_min[slot] = row_min;
+    level->node[slot] = node;
+    level->order[slot] = order;
+    beam_heap_sift_down(level, level->size, 0);
+    return slot;
+}
+
+/* Heap sort the slots of level, heap[] then lists them best first */
+static void beam_sort(BeamLevel *level){
+    for (int32_t end = level->size - 1; end > 0; end--){
+        int32_t tmp = level->heap[0];
+        level->heap[0] = level->heap[end];
+        level->heap[end] = tmp;
+        beam_heap_sift_down(level, end, 0);
+    }
+}
+
+/* Find pronunciations within max_cost edits of any segment of phonemes[0, n)
+   spanning at most max_span phonemes
+   matches receives (start, end, node) triples and costs their cost, room for
+   max_matches. Returns the number of matches found, which may exceed
+   max_matches, or -1 if out of memory. A node reached through different
+   paths of a minimized trie may be reported more than once */
+int32_t phoneme_trie_find_approximate_matches(const PhonemeTrie *trie, const uint8_t *phonemes, int32_t n,
+                                              const PhonemeCosts *costs, double max_cost,
+                                              int32_t max_span, int32_t beam_width,
+                                              int32_t *matches, double *costs_out, int32_t max_matches){
+    int32_t width = max_span + 1;
+    double *child_row = malloc((size_t)width * sizeof(double)); // scratch, the beam decides if it stays
+    if (!child_row){
+        return -1;
+    }
+    BeamLevel levels[2];
+    for (int k = 0; k < 2; k++){
+        levels[k].node = malloc((size_t)beam_width * sizeof(uint32_t));
+        levels[k].row_min = malloc((size_t)beam_width * sizeof(double));
+        levels[k].order = malloc((size_t)beam_width * sizeof(int32_t));
+        levels[k].rows = malloc((size_t)beam_width * width * sizeof(double));
+        levels[k].heap = malloc((size_t)beam_width * sizeof(int32_t));
+        if (!levels[k].node || !levels[k].row_min || !levels[k].order || !levels[k].rows || !levels[k].heap){
+            for (int j = 0; j <= k; j++){
+                free(levels[j].node);
+                free(levels[j].row_min);
+                free(levels[j].order);
+                free(levels[j].rows);
+                free(levels[j].heap);
+            }
+            free(child_row);
+            return -1;
+        }
+    }
+
+    int32_t num_matches = 0;
+    for (int32_t start = 0; start < n; start++){
+        const uint8_t *input = phonemes + start;
+        int32_t span = (n - start < max_span) ? n - start : max_span;
+
+        /* root row: only insertions */
+        BeamLevel *current = &levels[0];
+        BeamLevel *next = &levels[1];
+        current->size = 1;
+        current->node[0] = 0;
+        current->heap[0] = 0;
+        current->rows[0] = 0.0;
+        for (int32_t i = 1; i <= span; i++){
+            current->rows[i] = current->rows[i - 1] + costs->insertion[input[i - 1]];
+        }
+
+        while (current->size > 0){
+            next->size = 0;
+            int32_t num_candidates = 0;
+            for (int32_t k = 0; k < current->size; k++){
+                int32_t s = current->heap[k]; // best first
+                uint32_t node = current->node[s];
+                const double *row = current->rows + (size_t)s * width;
+                for (uint32_t e = trie->edge_start[node]; e < trie->edge_start[node + 1]; e++){
+                    uint8_t expected = trie->edge_phoneme[e];
+                    const float *substitution = costs->substitution + (size_t)expected * PHONEME_IDS;
+                    float deletion = costs->deletion[expected];
+
+                    child_row[0] = row[0] + deletion;
+                    double row_min = child_row[0];
+                    for (int32_t i = 1; i <= span; i++){
+                        double best = row[i - 1] + (input[i - 1] == expected ? 0.0 : substitution[input[i - 1]]);
+                        double by_deletion = row[i] + deletion;
+                        double by_insertion = child_row[i - 1] + costs->insertion[input[i - 1]];
+                        best = (by_deletion < best) ? by_deletion : best;
+                        best = (by_insertion < best) ? by_insertion : best;
+                        child_row[i] = best;
+                        row_min = (best < row_min) ? best : row_min;
+                    }
+                    if (row_min > max_cost){
+                        continue; // every extension costs at least row_min
+                    }
+
+                    uint32_t child = trie->edge_child[e];
+                    if (trie_is_terminal(trie, child)){
+                        for (int32_t i = 1; i <= span; i++){
+                            if (child_row[i] <= max_cost){
+                                if (num_matches < max_matches){
+                                    matches[3 * num_matches] = start;
+                                    matches[3 * num_matches + 1] = start + i;
+                                    matches[3 * num_matches + 2] = (int32_t)child;
+                                    costs_out[num_matches] = child_row[i];
+                                }
+                                num_matches++;
+                            }
+                        }
+                    }
+
+                    int32_t slot = beam_slot(next, beam_width, row_min, child, num_candidates++);
+                    if (slot >= 0){
+                        double *stored = next->rows + (size_t)slot * width;
+                        for (int32_t i = 0; i <= span; i++){
+                            stored[i] = child_row[i];
+                        }
+                    }
+                }
+            }
+            beam_sort(next);
+            BeamLevel *swap = current;
+            current = next;
+            next = swap;
+        }
+    }
+
+    for (int k = 0; k < 2; k++){
+        free(levels[k].node);
+        free(levels[k].row_min);
+        free(levels[k].order);
+        free(levels[k].rows);
+        free(levels[k].heap);
+    }
+    free(child_row);
+    return num_matches;
+}
+
+/*******************************************************************************
+ * REVERSE INDEX
+ *******************************************************************************/
+/* Layout must match PronunciationHashStruct in phonemes_sequence.py */
+typedef struct PronunciationHash {
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    const uint32_t *displacement;  // [num_buckets]
+    const uint32_t *slot_word;     // [num_slots], word ID or HASH_EMPTY
+    const uint32_t *word_offset;   // [num_words + 1] into pool
+    const uint8_t *pool;           // UTF-8 words
+    const uint32_t *pron_start;    // [num_words + 1] into pron_offset
+    const uint32_t *pron_offset;   // [num_pronunciations + 1] into pron_phonemes
+    const uint8_t *pron_phonemes;  // phoneme IDs
+} PronunciationHash;
+
+static int is_letter(uint8_t c){
+    return (uint8_t)((c | 0x20) - 'a') < 26;
+}
+
+static uint8_t to_upper(uint8_t c){
+    return (c >= 'a' && c <= 'z') ? (uint8_t)(c - 'a' + 'A') : c;
+}
+
+static uint64_t word_hash(const uint8_t *word, int64_t length){
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (int64_t i = 0; i < length; i++){
+        hash = (hash ^ to_upper(word[i])) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Slot hash for displacement d, splitmix64 finalizer */
+static uint64_t slot_hash(uint64_t hash, uint32_t d){
+    uint64_t x = hash ^ ((uint64_t)d * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Tokens looked up together: the dependent loads of each token (bucket,
+   slot, word, pronunciations) are prefetched for the whole batch one stage at
+   a time, so their cache misses overlap instead of being paid in sequence */
+typedef struct TokenBatch {
+    int32_t size;
+    int64_t start[LOOKUP_BATCH];
+    int64_t end[LOOKUP_BATCH];
+    uint64_t hash[LOOKUP_BATCH];
+    uint32_t id[LOOKUP_BATCH];    // slot word, HASH_EMPTY if none
+    int32_t word[LOOKUP_BATCH];   // word ID after the compare, -1 if unknown
+} TokenBatch;
+
+/* Next token of text[*pos, length) as [start, end), 0 at the end of the text */
+static int next_token(const uint8_t *text, int64_t length, int64_t *pos, int64_t *start, int64_t *end){
+    int64_t i = *pos;
+    while (i < length && !is_letter(text[i])){
+        i++;
+    }
+    if (i == length){
+        *pos = i;
+        return 0;
+    }
+    *start = i;
+    while (i < length && (is_letter(text[i]) || text[i] == '\'')){
+        i++;
+    }
+    *end = *pos = i;
+    return 1;
+}
+
+/* Tokenize up to LOOKUP_BATCH tokens from *pos and find their word IDs */
+static int32_t lookup_batch(const PronunciationHash *index, const uint8_t *text, int64_t length,
+                            int64_t *pos, TokenBatch *batch){
+    batch->size = 0;
+    while (batch->size < LOOKUP_BATCH &&
+           next_token(text, length, pos, &batch->start[batch->size], &batch->end[batch->size])){
+        uint64_t hash = word_hash(text + batch->start[batch->size], batch->end[batch->size] - batch->start[batch->size]);
+        batch->hash[batch->size] = hash;
+        PREFETCH(&index->displacement[hash % index->num_buckets]);
+        batch->size++;
+    }
+    for (int32_t t = 0; t < batch->size; t++){
+        uint64_t hash = batch->hash[t];
+        uint32_t d = index->displacement[hash % index->num_buckets];
+        batch->hash[t] = slot_hash(hash, d) % index->num_slots;
+        PREFETCH(&index->slot_word[batch->hash[t]]);
+    }
+    for (int32_t t = 0; t < batch->size; t++){
+        uint32_t id = index->slot_word[batch->hash[t]];
+        batch->id[t] = id;
+        if (id != HASH_EMPTY){
+            PREFETCH(&index->word_offset[id]);
+            PREFETCH(&index->pron_start[id]);
+        }
+    }
+    for (int32_t t = 0; t < batch->size; t++){
+        if (batch->id[t] != HASH_EMPTY){
+            PREFETCH(index->pool + index->word_offset[batch->id[t]]);
+        }
+    }
+    for (int32_t t = 0; t < batch->size; t++){
+        /* words not in the dictionary land on some slot, compare to be sure */
+        uint32_t id = batch->id[t];
+        int64_t token_length = batch->end[t] - batch->start[t];
+        batch->word[t] = -1;
+        if (id == HASH_EMPTY || index->word_offset[id + 1] - index->word_offset[id] != (uint64_t)token_length){
+            continue;
+        }
+        const uint8_t *stored = index->pool + index->word_offset[id];
+        const uint8_t *token = text + batch->start[t];
+        int64_t i = 0;
+        while (i < token_length && to_upper(stored[i]) == to_upper(token[i])){
+            i++;
+        }
+        if (i == token_length){
+            batch->word[t] = (int32_t)id;
+            PREFETCH(&index->pron_offset[index->pron_start[id]]);
+        }
+    }
+    return batch->size;
+}
+
+/* Tokenize text[0, length) and look every token up
+   bounds receives (start, end) byte offsets and word_ids the word ID or -1 of
+   each token, room for max_tokens. Returns the number of tokens, which may
+   exceed max_tokens (length / 2 + 1 is always enough) */
+int64_t pronunciation_hash_lookup_tokens(const PronunciationHash *index, const uint8_t *text, int64_t length,
+                                         int64_t *bounds, int32_t *word_ids, int64_t max_tokens){
+    TokenBatch batch;
+    int64_t num_tokens = 0;
+    int64_t pos = 0;
+    while (lookup_batch(index, text, length, &pos, &batch) > 0){
+        for (int32_t t = 0; t < batch.size; t++){
+            if (num_tokens < max_tokens){
+                bounds[2 * num_tokens] = batch.start[t];
+                bounds[2 * num_tokens + 1] = batch.end[t];
+                word_ids[num_tokens] = batch.word[t];
+            }
+            num_tokens++;
+        }
+    }
+    return num_tokens;
+}
+
+/* Write one line per token of text[0, length) to out:
+     token<TAB>P1 P2 ... | P1 P2 ...<LF>
+   with all pronunciations of the token, nothing after the tab if it is not in
+   the dictionary. symbols are the phoneme symbols of the compiled dictionary.
+   Stops before the first line that does not fit in capacity bytes, *consumed
+   is set to the end of the last converted token, or to length when the whole
+   text was converted. Returns the number of bytes written */
+int64_t pronunciation_hash_transcribe(const PronunciationHash *index, const char *symbols, int32_t num_symbols,
+                                      const uint8_t *text, int64_t length,
+                                      char *out, int64_t capacity, int64_t *consumed){
+    /* symbols padded to 8 bytes are copied whole, the output pointer only
+       advances by their length */
+    uint64_t symbol[PHONEME_IDS] = {0};
+    int32_t symbol_length[PHONEME_IDS] = {0};
+    for (int32_t p = 0; p < num_symbols && p < PHONEME_IDS; p++){
+        memcpy(&symbol[p], symbols + (size_t)p * PHONEME_SYMBOL_SIZE, PHONEME_SYMBOL_SIZE);
+        while (symbol_length[p] < PHONEME_SYMBOL_SIZE && symbols[(size_t)p * PHONEME_SYMBOL_SIZE + symbol_length[p]] != '\0'){
+            symbol_length[p]++;
+        }
+    }
+
+    TokenBatch batch;
+    int64_t written = 0;
+    int64_t pos = 0;
+    *consumed = 0;
+    while (lookup_batch(index, text, length, &pos, &batch) > 0){
+        for (int32_t t = 0; t < batch.size; t++){
+            int64_t start = batch.start[t];
+            int64_t end = batch.end[t];
+            uint32_t first = 0, last = 0;
+            int64_t line = (end - start) + 2; // token, tab, newline
+            if (batch.word[t] >= 0){
+                first = index->pron_start[batch.word[t]];
+                last = index->pron_start[batch.word[t] + 1];
+                for (uint32_t k = first; k < last; k++){
+                    line += 3; // " | " before all but the first, slack for the last symbol
+                    for (uint32_t j = index->pron_offset[k]; j < index->pron_offset[k + 1]; j++){
+                        line += PHONEME_SYMBOL_SIZE + 1;
+                    }
+                }
+            }
+            if (written + line > capacity){
+                return written; // continue from *consumed with an empty buffer
+            }
+
+            memcpy(out + written, text + start, (size_t)(end - start));
+            written += end - start;
+            out[written++] = '\t';
+            for (uint32_t k = first; k < last; k++){
+                if (k > first){
+                    memcpy(out + written, " | ", 3);
+                    written += 3;
+                }
+                for (uint32_t j = index->pron_offset[k]; j < index->pron_offset[k + 1]; j++){
+                    if (j > index->pron_offset[k]){
+                        out[written++] = ' ';
+                    }
+                    uint8_t phoneme = index->pron_phonemes[j];
+                    memcpy(out + written, &symbol[phoneme], PHONEME_SYMBOL_SIZE);
+                    written += symbol_length[phoneme];
+                }
+            }
+            out[written++] = '\n';
+            *consumed = end;
+        }
+    }
+    *consumed = length;
+    return written;
+}
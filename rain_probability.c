@@ -32,30 +32,322 @@
  *
  * 2) P(S > n) = sum(pmf(k)) where k = n + 1, ..., 365
  * 
+ * 3) Rainy days share weather systems, so they are not really independent.
+ *    A one-factor Gaussian copula keeps every p[i] but correlates the days:
+ *    i) a shared weather factor Z ~ N(0, 1) is drawn for the year, and given Z
+ *       the days are independent with shifted probabilities
+ *         p[i](Z) = Phi((Phi^-1(p[i]) - sqrt(rho) * Z) / sqrt(1 - rho))
+ *       where rho in [0, 1) is the correlation of the latent daily weather
+ *       (rho = 0 is the independent model above)
+ *   ii) the PMF is the mixture over Z of Poisson binomial PMFs, integrated with
+ *       quadrature: pmf(k) = sum_q w[q] * pmf(k | Z = z[q]). Given Z the count
+ *       is concentrated, so P(S > n | Z) is almost a step in Z for large rho,
+ *       which Gauss-Hermite nodes resolve badly. Equal weight nodes at the
+ *       quantiles z[q] = Phi^-1((q + 1/2) / m) (midpoint rule on the
+ *       probability scale) converge much faster: 32 nodes are within 1e-6 of
+ *       the limit up to rho = 0.6
+ *  iii) the PMFs of all quadrature nodes are computed together in one batch
+ *       with the nodes as lanes (p laid out [day][lane], pmf [k][lane]), 4
+ *       lanes per SSE2 register, so the model costs a small multiple of a
+ *       single independent PMF
+ *
+ * 4) The recursion in 1) passes through the PMF of the rain count S_d after
+ *    each day d, so P(more than n rainy days by date d) for every date comes
+ *    from the same single pass:
+ *    i) every intermediate PMF is handed to a callback, or stored in a
+ *       triangular buffer where the PMF after d days (d + 1 entries) starts
+ *       at TRIANGLE_OFFSET(d), (N + 1)(N + 2) / 2 floats in total
+ *   ii) for thresholds only, S_d > n happens if S_(d-1) > n already, or if
+ *       S_(d-1) = n and it rains on day d:
+ *         P(S_d > n) = P(S_(d-1) > n) + p[d] * P(S_(d-1) = n)
+ *       so the PMF is only needed up to the largest threshold and each day
+ *       costs O(max n) instead of O(d)
+ *
+ * 5) Float results depend on the compiler, FMA contraction and SIMD width, so
+ *    golden-file tests use a fixed-point engine that gives the same bits on
+ *    every machine:
+ *    i) probabilities are Q0.62 integers in uint64_t, Q62_ONE = 2^62 is 1.0,
+ *       floats convert exactly for p >= 2^-39 (24-bit mantissa, the lowest
+ *       bit is then at least 2^-62), smaller p are rounded to the nearest
+ *       Q0.62 value (half up), an error of at most 2^-63
+ *   ii) each PMF update is pmf[j] = (q * pmf[j-1] + (1 - q) * pmf[j] + 2^61) >> 62
+ *       with the two products summed exactly in 128 bits and a single
+ *       round-half-up, using unsigned __int128 where the compiler has it and
+ *       32-bit limbs otherwise (same result)
+ *  iii) 1 - q is computed exactly as Q62_ONE - q, so every step conserves
+ *       the total up to rounding and the tail sum cannot overflow
+ *
+ * 6) Stations with different forecast horizons are computed in one ragged
+ *    batch: station s has the days p[offsets[s] .. offsets[s+1]) and its PMF
+ *    is written at pmf + offsets[s] + s (one more entry than days)
+ *    i) stations are sorted by length and groups of rain_tuning.ragged_lanes
+ *       similar lengths run as lanes of prob_mass_func_batch(), shorter stations
+ *       padded with p = 0 days, which leave their PMF unchanged
+ *   ii) a group costs O(longest length^2), groups are handed out longest
+ *       first to OpenMP threads with dynamic scheduling so the short groups
+ *       fill in behind the long ones
+ *
+ * 7) Top K stations by P(S > n) only run the O(N^2) engine where needed:
+ *    i) O(N) bounds per station from mu = sum p, sigma^2 = sum p (1 - p):
+ *       Chernoff, P(S >= a) <= exp(-t a) prod(1 - p + p e^t) for any t > 0
+ *       (a few Newton steps towards the best t) and the same for the lower
+ *       tail, and the normal approximation with the Berry-Esseen error
+ *         |P(S <= x) - Phi((x - mu) / sigma)| <= 0.56 * sum E|X - p|^3 / sigma^3
+ *       taken at x = n and x -> n + 1 since P(S <= x) is constant between
+ *   ii) the K-th largest lower bound is a value the answer must reach, so
+ *       every station whose upper bound is below it is pruned
+ *  iii) the survivors are computed exactly with the ragged batch in chunks,
+ *       highest upper bound first, stopping once the k-th exact probability
+ *       beats every remaining upper bound
+ *   iv) the bounds hold for the exact P(S > n) but the ranking is by the
+ *       float engine, so both comparisons leave room for its error. Every
+ *       PMF update is a convex combination, an error already in the PMF does
+ *       not grow, and each day adds at most 6 roundings (1 - q, products and
+ *       sums, two fused days take 11) of FLT_EPSILON relative to a total
+ *       mass of 1, plus less than 2 FLT_MIN per entry flushed to zero:
+ *         |float - exact| <= (6 + 1) N FLT_EPSILON + 2 FLT_MIN N (N + 1)
+ *       where the + 1 covers the tail sum. A station is pruned only when its
+ *       upper bound is below the cutoff by twice the bound of the longest
+ *       station, its own error plus that of the station it loses to
+ *
+ * 8) The batch kernel configuration is tuned per CPU model on the first call
+ *    of prob_mass_func_batch() or prob_mass_func_ragged():
+ *    i) variants are the ragged group width (4, 8 or 16 lanes) and the day
+ *       fusion factor, 2 folds two days into one sweep over the PMF rows
+ *         pmf'[j] = q1 q2 pmf[j-2] + (q1 + q2 - 2 q1 q2) pmf[j-1]
+ *                   + (1 - q1)(1 - q2) pmf[j]
+ *       halving the passes over memory for a few more multiplies per entry
+ *   ii) the fastest variant on a fixed ragged workload is appended to a small
+ *       text database in the user's cache directory
+ *       ($XDG_CACHE_HOME/rain_probability/rain_tuning.db, ~/.cache when unset,
+ *       RAIN_TUNING_DB overrides the path) as "vendor:family:model lanes
+ *       fusion" from CPUID, later runs on the same CPU model load it instead
+ *       of benchmarking
+ *  iii) day fusion rounds differently from one day per sweep, so results of
+ *       the batch kernel (the correlated model) can differ in the last bits
+ *       between CPU models
+ *
+ * 9) Certified bounds on P(S > n) propagate a lower and an upper PMF through
+ *    the same convolution with directed rounding:
+ *    i) every coefficient and entry is non-negative, so rounding each step
+ *       down (up) keeps a lower (upper) bound of the exact PMF of the given
+ *       float p, with 1 - q rounded down (up) as well
+ *   ii) the upper PMF is stored negated, rd(-x) = -ru(x), so both bounds
+ *       run with the rounding mode set once to round-down for the whole
+ *       kernel, interleaved as (lower, -upper) pairs, two rows per SSE2
+ *       register
+ *  iii) with FTZ | DAZ on a product can flush to 0 and lose less than
+ *       FLT_MIN, each upper entry adds 2 FLT_MIN per day to cover the two
+ *       products, which also keeps the upper tail out of the subnormals
+ *   iv) the total is exactly 1, so the tail is also bounded through the
+ *       head, 1 - sum(upper[0..n]) <= P(S > n) <= 1 - sum(lower[0..n]), and
+ *       the tighter side of each is kept
+ *    v) the compiler assumes round-to-nearest unless built with
+ *       -frounding-math, and may fold or move float arithmetic across the
+ *       mode switch. The rounded sections are also noinline functions called
+ *       between the switches, so their arithmetic cannot leave the region
+ *
+ * n < 0 gives P(S > n) = 1 and n >= number of days gives 0 in every engine
+ *
  * Reference:
  * https://en.wikipedia.org/wiki/Poisson_binomial_distribution
+ * P. J. Acklam, An algorithm for computing the inverse normal cumulative
+ * distribution function (rational approximation used by inverse_normal_cdf)
+ * I. Shevtsova, An improvement of convergence rate estimates in the Lyapunov
+ * theorem (Berry-Esseen constant 0.56 for non-identical summands)
+ *
+ * Build:
+ * gcc -O2 -fopenmp -frounding-math rain_probability.c -o rain_probability -lm
  */
 
+#include <float.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#else
+#include <fenv.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 #define DAYSPERYEAR 365
+#define FACTOR_QUADRATURE_NODES 32 // quadrature nodes over the weather factor
+#define TRIANGLE_OFFSET(d) ((size_t)(d) * ((d) + 1) / 2) // PMF after d days in a triangle
+#define Q62_ONE ((uint64_t)1 << 62) // 1.0 in the fixed-point engine
+#define INTERVAL_SLACK (2 * FLT_MIN)  // flushed products per upper PMF update
+#define RAGGED_LANES 8              // default stations per group in the ragged batch
+#define MAX_RAGGED_LANES 16
+#define RAIN_TUNING_DIR "rain_probability"  // under the user's cache directory
+#define RAIN_TUNING_DB "rain_tuning.db"
+#define TUNING_KEY_SIZE 64
+#define TUNING_REPEATS 3
+#define BERRY_ESSEEN_CONSTANT 0.56
+#define CHERNOFF_NEWTON_STEPS 4
+#define EXACT_ROUNDINGS_PER_DAY 6   // float roundings per entry and day in the batch kernel
+#define TOP_K_CHUNK 256             // survivors computed exactly per ragged batch
 
-void prob_mass_func(float *p, float* pmf){
+typedef void (*PrefixPMFCallback)(int day, const float *pmf, void *context);
+
+typedef struct RainTuning {
+    int ragged_lanes; // stations per group in prob_mass_func_ragged()
+    int day_fusion;   // days folded into one sweep of prob_mass_func_batch()
+} RainTuning;
+
+static RainTuning rain_tuning = {RAGGED_LANES, 1};
+static atomic_int rain_tuning_ready = 0; // release after rain_tuning is written
+
+const RainTuning *rain_tuning_get(void);
+
+void prob_mass_func_n(const float *p, int num_days, float *pmf){
     // Direct convolution algorithm for computing PMF of Poisson binomial
+    // after adding day i the PMF covers 0..i rainy days, pmf has num_days + 1 entries
     pmf[0] = 1.0;
-    for (int i = 1; i <= DAYSPERYEAR; i++){
-        pmf[i] = p[i] * pmf[i-1];
+    for (int i = 1; i <= num_days; i++){
+        float q = p[i-1];
+        pmf[i] = q * pmf[i-1];
         for (int j = i - 1; j > 0; j--){
-            pmf[j] = p[i] * pmf[j-1] + (1 - p[i]) * pmf[j];
+            pmf[j] = q * pmf[j-1] + (1 - q) * pmf[j];
+        }
+        pmf[0] = (1 - q) * pmf[0];
+    }
+}
+
+void prob_mass_func(float *p, float* pmf){
+    prob_mass_func_n(p, DAYSPERYEAR, pmf);
+}
+
+static void batch_add_day(const float *q, int days, int num_lanes, float *pmf){
+    // fold one day into a batch PMF that covers 0..days rainy days
+    float *top = pmf + (size_t)(days + 1) * num_lanes;
+    for (int l = 0; l < num_lanes; l++){
+        top[l] = q[l] * top[l - num_lanes];
+    }
+    for (int j = days; j > 0; j--){
+        float *row = pmf + (size_t)j * num_lanes;
+        const float *below = row - num_lanes;
+        int l = 0;
+#ifdef __SSE2__
+        for (; l + 4 <= num_lanes; l += 4){
+            __m128 rain = _mm_loadu_ps(q + l);
+            __m128 dry = _mm_sub_ps(_mm_set1_ps(1.0f), rain);
+            _mm_storeu_ps(row + l, _mm_add_ps(_mm_mul_ps(rain, _mm_loadu_ps(below + l)),
+                                              _mm_mul_ps(dry, _mm_loadu_ps(row + l))));
+        }
+#endif
+        for (; l < num_lanes; l++){
+            row[l] = q[l] * below[l] + (1 - q[l]) * row[l];
+        }
+    }
+    for (int l = 0; l < num_lanes; l++){
+        pmf[l] = (1 - q[l]) * pmf[l];
+    }
+}
+
+static void batch_add_two_days(const float *q1, const float *q2, int days, int num_lanes, float *pmf,
+                               float *coefficients){
+    // fold two days into a batch PMF that covers 0..days rainy days in one
+    // sweep, see Solution 8), rows above days are still unwritten.
+    // coefficients is scratch for 3 * num_lanes floats
+    float *r2 = coefficients, *r1 = coefficients + num_lanes, *r0 = coefficients + 2 * num_lanes;
+    for (int l = 0; l < num_lanes; l++){
+        r2[l] = q1[l] * q2[l];
+        r1[l] = q1[l] + q2[l] - 2 * r2[l];
+        r0[l] = (1 - q1[l]) * (1 - q2[l]);
+    }
+    float *row = pmf + (size_t)(days + 2) * num_lanes;
+    for (int l = 0; l < num_lanes; l++){
+        row[l] = r2[l] * row[l - 2 * num_lanes];
+    }
+    if (days >= 1){
+        row = pmf + (size_t)(days + 1) * num_lanes;
+        for (int l = 0; l < num_lanes; l++){
+            row[l] = r2[l] * row[l - 2 * num_lanes] + r1[l] * row[l - num_lanes];
+        }
+    }
+    for (int j = days; j >= 2; j--){
+        row = pmf + (size_t)j * num_lanes;
+        const float *below = row - num_lanes;
+        const float *below2 = below - num_lanes;
+        int l = 0;
+#ifdef __SSE2__
+        for (; l + 4 <= num_lanes; l += 4){
+            __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r2 + l), _mm_loadu_ps(below2 + l)),
+                                    _mm_mul_ps(_mm_loadu_ps(r1 + l), _mm_loadu_ps(below + l)));
+            _mm_storeu_ps(row + l, _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(r0 + l), _mm_loadu_ps(row + l))));
+        }
+#endif
+        for (; l < num_lanes; l++){
+            row[l] = r2[l] * below2[l] + r1[l] * below[l] + r0[l] * row[l];
+        }
+    }
+    if (days >= 1){
+        row = pmf + num_lanes;
+        for (int l = 0; l < num_lanes; l++){
+            row[l] = r1[l] * pmf[l] + r0[l] * row[l];
+        }
+    }
+    else {
+        row = pmf + num_lanes;
+        for (int l = 0; l < num_lanes; l++){
+            row[l] = r1[l] * pmf[l];
+        }
+    }
+    for (int l = 0; l < num_lanes; l++){
+        pmf[l] = r0[l] * pmf[l];
+    }
+}
+
+static void batch_kernel(const float *p, int num_days, int num_lanes, const RainTuning *tuning, float *pmf){
+    // prob_mass_func_batch() with the given configuration
+#ifdef __SSE2__
+    // far tails of the PMF underflow, subnormal floats are many times slower
+    // and below 1.2e-38 anyway, so flush them to zero while the kernel runs
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | 0x8040); // FTZ | DAZ
+#endif
+    for (int l = 0; l < num_lanes; l++){
+        pmf[l] = 1.0;
+    }
+    int days = 0;
+    if (tuning->day_fusion == 2 && num_days >= 2){
+        float *coefficients = malloc((size_t)num_lanes * 3 * sizeof(float));
+        if (!coefficients){
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
         }
-        pmf[0] = (1 - p[i]) * pmf[0];
+        for (; days + 2 <= num_days; days += 2){
+            batch_add_two_days(p + (size_t)days * num_lanes, p + (size_t)(days + 1) * num_lanes,
+                               days, num_lanes, pmf, coefficients);
+        }
+        free(coefficients);
+    }
+    for (; days < num_days; days++){
+        batch_add_day(p + (size_t)days * num_lanes, days, num_lanes, pmf);
     }
+#ifdef __SSE2__
+    _mm_setcsr(csr);
+#endif
+}
+
+void prob_mass_func_batch(const float *p, int num_days, int num_lanes, float *pmf){
+    // prob_mass_func_n() of num_lanes independent sequences at once
+    // p[day * num_lanes + lane], pmf[k * num_lanes + lane] for k = 0..num_days
+    // rows are updated from the top down, each row is a contiguous run of lanes
+    // processed 4 at a time in SSE2 registers, day_fusion days per sweep
+    batch_kernel(p, num_days, num_lanes, rain_tuning_get(), pmf);
 }
 
 float prob_rain_more_than_n(float *p, int n){
     if (n < 0 || n >= DAYSPERYEAR){
-        return 0.0;
+        return (n < 0) ? 1.0 : 0.0;
     }
 
     // Initialize PMF array (probability of 0 days of rain to 365 days of rain)
@@ -76,6 +368,908 @@ float prob_rain_more_than_n(float *p, int n){
     return probability;
 }
 
+/*******************************************************************************
+ * RAIN BY DATE
+ *******************************************************************************/
+void prob_mass_func_prefixes(const float *p, int num_days, float *pmf,
+                             PrefixPMFCallback callback, void *context){
+    // prob_mass_func_n() calling callback(d, pmf, context) after each day
+    // d = 1..num_days, pmf[0..d] is then the PMF of the rain count by day d and
+    // is only valid during the call
+    pmf[0] = 1.0;
+    for (int i = 1; i <= num_days; i++){
+        float q = p[i-1];
+        pmf[i] = q * pmf[i-1];
+        for (int j = i - 1; j > 0; j--){
+            pmf[j] = q * pmf[j-1] + (1 - q) * pmf[j];
+        }
+        pmf[0] = (1 - q) * pmf[0];
+        callback(i, pmf, context);
+    }
+}
+
+static void store_in_triangle(int day, const float *pmf, void *context){
+    float *triangle = (float *)context;
+    for (int k = 0; k <= day; k++){
+        triangle[TRIANGLE_OFFSET(day) + k] = pmf[k];
+    }
+}
+
+void prob_mass_func_triangle(const float *p, int num_days, float *triangle){
+    // PMFs after every day 0..num_days, the one after d days is
+    // triangle[TRIANGLE_OFFSET(d) .. TRIANGLE_OFFSET(d) + d], triangle holds
+    // TRIANGLE_OFFSET(num_days + 1) floats. The last row is the working PMF
+    triangle[0] = 1.0;
+    prob_mass_func_prefixes(p, num_days, triangle + TRIANGLE_OFFSET(num_days), store_in_triangle, triangle);
+}
+
+void prob_rain_more_than_thresholds_by_day(const float *p, int num_days, const int *n, int num_thresholds,
+                                           float *probability){
+    // probability[d * num_thresholds + t] = P(S > n[t]) counting days 0..d,
+    // see Solution 4) ii), negative thresholds give 1
+    int max_n = 0;
+    for (int t = 0; t < num_thresholds; t++){
+        max_n = (n[t] > max_n) ? n[t] : max_n;
+    }
+
+    // PMF truncated to 0..max_n, entries above are never needed
+    float *pmf = calloc((size_t)max_n + 1, sizeof(float));
+    float *tail = calloc((size_t)num_thresholds + 1, sizeof(float));
+    if (!pmf || !tail){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pmf[0] = 1.0;
+    for (int i = 1; i <= num_days; i++){
+        float q = p[i-1];
+        for (int t = 0; t < num_thresholds; t++){
+            tail[t] = (n[t] < 0) ? 1.0f : tail[t] + q * pmf[n[t]];
+            probability[(size_t)(i-1) * num_thresholds + t] = tail[t];
+        }
+        if (i <= max_n){
+            pmf[i] = q * pmf[i-1];
+        }
+        for (int j = (i - 1 < max_n) ? i - 1 : max_n; j > 0; j--){
+            pmf[j] = q * pmf[j-1] + (1 - q) * pmf[j];
+        }
+        pmf[0] = (1 - q) * pmf[0];
+    }
+    free(pmf);
+    free(tail);
+}
+
+void prob_rain_more_than_n_by_day(float *p, int n, float *probability){
+    // probability[d] = P(rains more than n days in January 1 .. day d) for
+    // the 365 days of the year
+    prob_rain_more_than_thresholds_by_day(p, DAYSPERYEAR, &n, 1, probability);
+}
+
+/*******************************************************************************
+ * FIXED-POINT ENGINE (BIT-EXACT)
+ *******************************************************************************/
+uint64_t probability_to_q62(float p){
+    // exact for p in [2^-39, 1], nearest Q0.62 value (half up) below, see
+    // Solution 5)
+    if (!(p > 0.0f)){
+        return 0;
+    }
+    if (p >= 1.0f){
+        return Q62_ONE;
+    }
+    double x = ldexp((double)p, 62); // exact in double
+    uint64_t q = (uint64_t)x;
+    return (x - (double)q >= 0.5) ? q + 1 : q; // exact difference, same in any rounding mode
+}
+
+double q62_to_double(uint64_t x){
+    return ldexp((double)x, -62);
+}
+
+static inline uint64_t q62_mix(uint64_t a, uint64_t x, uint64_t b, uint64_t y){
+    // (a * x + b * y + 2^61) >> 62 without intermediate rounding
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 sum = (unsigned __int128)a * x + (unsigned __int128)b * y + ((uint64_t)1 << 61);
+    return (uint64_t)(sum >> 62);
+#else
+    // 128-bit products from 32-bit limbs: (hi, lo) pairs
+    uint64_t factors[2][2] = {{a, x}, {b, y}};
+    uint64_t hi = 0, lo = (uint64_t)1 << 61;
+    for (int k = 0; k < 2; k++){
+        uint64_t u = factors[k][0], v = factors[k][1];
+        uint64_t u0 = u & 0xFFFFFFFFu, u1 = u >> 32;
+        uint64_t v0 = v & 0xFFFFFFFFu, v1 = v >> 32;
+        uint64_t p00 = u0 * v0, p01 = u0 * v1, p10 = u1 * v0, p11 = u1 * v1;
+        uint64_t middle = (p00 >> 32) + (p01 & 0xFFFFFFFFu) + (p10 & 0xFFFFFFFFu);
+        uint64_t product_lo = (middle << 32) | (p00 & 0xFFFFFFFFu);
+        uint64_t product_hi = p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32);
+        lo += product_lo;
+        hi += product_hi + (lo < product_lo);
+    }
+    return (hi << 2) | (lo >> 62);
+#endif
+}
+
+void prob_mass_func_fixed(const uint64_t *p, int num_days, uint64_t *pmf){
+    // prob_mass_func_n() in Q0.62, see Solution 5)
+    pmf[0] = Q62_ONE;
+    for (int i = 1; i <= num_days; i++){
+        uint64_t rain = p[i-1];
+        uint64_t dry = Q62_ONE - rain;
+        pmf[i] = q62_mix(rain, pmf[i-1], 0, 0);
+        for (int j = i - 1; j > 0; j--){
+            pmf[j] = q62_mix(rain, pmf[j-1], dry, pmf[j]);
+        }
+        pmf[0] = q62_mix(dry, pmf[0], 0, 0);
+    }
+}
+
+uint64_t prob_rain_more_than_n_fixed(float *p, int n){
+    // prob_rain_more_than_n() in Q0.62, identical bits on every machine
+    if (n < 0 || n >= DAYSPERYEAR){
+        return (n < 0) ? Q62_ONE : 0;
+    }
+
+    uint64_t p_fixed[DAYSPERYEAR];
+    uint64_t pmf[DAYSPERYEAR + 1];
+    for (int i = 0; i < DAYSPERYEAR; i++){
+        p_fixed[i] = probability_to_q62(p[i]);
+    }
+    prob_mass_func_fixed(p_fixed, DAYSPERYEAR, pmf);
+
+    uint64_t probability = 0;
+    for (int k = n + 1; k <= DAYSPERYEAR; k++){
+        probability += pmf[k];
+    }
+    return probability;
+}
+
+/*******************************************************************************
+ * CERTIFIED INTERVALS
+ *******************************************************************************/
+static __attribute__((noinline)) unsigned int round_down_begin(void){
+    // switch to round-down once per kernel, see Solution 9)
+#ifdef __SSE2__
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr((csr & ~0x6000u) | 0x2000u | 0x8040u); // round down, FTZ | DAZ
+    return csr;
+#else
+    unsigned int mode = (unsigned int)fegetround();
+    fesetround(FE_DOWNWARD);
+    return mode;
+#endif
+}
+
+static __attribute__((noinline)) void round_down_end(unsigned int state){
+#ifdef __SSE2__
+    _mm_setcsr(state);
+#else
+    fesetround((int)state);
+#endif
+}
+
+static __attribute__((noinline)) void interval_kernel(const float *p, int num_days, float *bounds){
+    // bounds[2k] <= P(S = k) <= -bounds[2k + 1] for k = 0..num_days, bounds
+    // must be zeroed and the rounding mode already round-down
+    bounds[0] = 1.0f;
+    bounds[1] = -1.0f;
+    for (int i = 1; i <= num_days; i++){
+        float q = p[i-1];
+        float dry_down = 1.0f - q;
+        float dry_up = -(q - 1.0f);
+        int j = i;
+#ifdef __SSE2__
+        __m128 rain = _mm_set1_ps(q);
+        __m128 dry = _mm_setr_ps(dry_down, dry_up, dry_down, dry_up);
+        __m128 slack = _mm_setr_ps(0.0f, -INTERVAL_SLACK, 0.0f, -INTERVAL_SLACK);
+        for (; j >= 2; j -= 2){
+            // rows j - 1 and j from rows j - 2 .. j, all read before the store
+            float *rows = bounds + 2 * (j - 1);
+            __m128 sum = _mm_add_ps(_mm_mul_ps(rain, _mm_loadu_ps(rows - 2)),
+                                    _mm_mul_ps(dry, _mm_loadu_ps(rows)));
+            _mm_storeu_ps(rows, _mm_add_ps(sum, slack));
+        }
+#endif
+        for (; j >= 1; j--){
+            float *row = bounds + 2 * j;
+            row[0] = q * row[-2] + dry_down * row[0];
+            row[1] = (q * row[-1] + dry_up * row[1]) - INTERVAL_SLACK;
+        }
+        bounds[0] = dry_down * bounds[0];
+        bounds[1] = dry_up * bounds[1] - INTERVAL_SLACK;
+    }
+}
+
+static __attribute__((noinline)) void interval_tail_sums(const float *bounds, int num_days, int n, float *tails){
+    // lower bounds of P(S > n) from the head and the tail, then upper bounds
+    // from the head and the tail, rounding mode already round-down
+    // sums rounded down, negated upper sums are upper sums rounded up
+    float lower_head = 0.0f, negated_upper_head = 0.0f;
+    float lower_tail = 0.0f, negated_upper_tail = 0.0f;
+    for (int k = 0; k <= n; k++){
+        lower_head += bounds[2 * k];
+        negated_upper_head += bounds[2 * k + 1];
+    }
+    for (int k = n + 1; k <= num_days; k++){
+        lower_tail += bounds[2 * k];
+        negated_upper_tail += bounds[2 * k + 1];
+    }
+    tails[0] = 1.0f + negated_upper_head;
+    tails[1] = lower_tail;
+    tails[2] = -(lower_head - 1.0f);
+    tails[3] = -negated_upper_tail;
+}
+
+void prob_mass_func_interval(const float *p, int num_days, float *lower, float *upper){
+    // lower[k] <= P(S = k) <= upper[k] for k = 0..num_days, guaranteed
+    float *bounds = calloc((size_t)(num_days + 1) * 2, sizeof(float));
+    if (!bounds){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int state = round_down_begin();
+    interval_kernel(p, num_days, bounds);
+    round_down_end(state);
+    for (int k = 0; k <= num_days; k++){
+        lower[k] = bounds[2 * k];
+        upper[k] = -bounds[2 * k + 1];
+    }
+    free(bounds);
+}
+
+void prob_rain_more_than_n_interval(float *p, int n, float *lower, float *upper){
+    // *lower <= P(S > n) <= *upper, guaranteed for the given p
+    if (n < 0 || n >= DAYSPERYEAR){
+        *lower = *upper = (n < 0) ? 1.0f : 0.0f;
+        return;
+    }
+    float bounds[2 * (DAYSPERYEAR + 1)] = {0};
+    float tails[4];
+    unsigned int state = round_down_begin();
+    interval_kernel(p, DAYSPERYEAR, bounds);
+    interval_tail_sums(bounds, DAYSPERYEAR, n, tails);
+    round_down_end(state);
+
+    *lower = (tails[0] > tails[1]) ? tails[0] : tails[1];
+    *upper = (tails[2] < tails[3]) ? tails[2] : tails[3];
+    *lower = (*lower > 0.0f) ? *lower : 0.0f;
+    *upper = (*upper < 1.0f) ? *upper : 1.0f;
+}
+
+/*******************************************************************************
+ * CORRELATED DAYS (LATENT WEATHER FACTOR)
+ *******************************************************************************/
+double normal_cdf(double x){
+    return 0.5 * erfc(-x / sqrt(2.0));
+}
+
+double inverse_normal_cdf(double p){
+    // Acklam's rational approximation, relative error < 1.15e-9
+    // p must be in (0, 1)
+    static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                               1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+    static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                               6.680131188771972e+01, -1.328068155288572e+01};
+    static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                               -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+    static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                               3.754408661907416e+00};
+    const double p_low = 0.02425;
+
+    if (p < p_low){
+        double q = sqrt(-2 * log(p));
+        return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+               ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+    }
+    if (p > 1 - p_low){
+        double q = sqrt(-2 * log(1 - p));
+        return -(((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+                ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1);
+    }
+    double q = p - 0.5;
+    double r = q * q;
+    return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q /
+           (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1);
+}
+
+void factor_quadrature(int num_nodes, double *z, double *w){
+    // nodes z and weights w such that E[f(Z)] ~ sum w[q] * f(z[q]) for Z ~ N(0, 1):
+    // midpoint rule on the probability scale, z[q] = Phi^-1((q + 1/2) / m)
+    for (int q = 0; q < num_nodes; q++){
+        z[q] = inverse_normal_cdf((q + 0.5) / num_nodes);
+        w[q] = 1.0 / num_nodes;
+    }
+}
+
+double rain_threshold(float p){
+    // Phi^-1(p): it rains on a day when its latent weather is below this
+    if (p <= 0.0f){
+        return -INFINITY;
+    }
+    if (p >= 1.0f){
+        return INFINITY;
+    }
+    return inverse_normal_cdf(p);
+}
+
+float conditional_rain_probability(double threshold, double threshold_scale, double loading, double z){
+    // p[i](Z = z) of the one-factor Gaussian copula, see Solution 3), float
+    // erfc is accurate enough for a float probability and much cheaper
+    return 0.5f * erfcf((float)((loading * z - threshold) * threshold_scale * M_SQRT1_2));
+}
+
+void prob_mass_func_correlated(const float *p, int num_days, float rho, float *pmf){
+    // mixture over the weather factor of the Poisson binomial PMFs, rho in [0, 1)
+    int lanes = FACTOR_QUADRATURE_NODES;
+    double z[FACTOR_QUADRATURE_NODES], w[FACTOR_QUADRATURE_NODES];
+    factor_quadrature(lanes, z, w);
+
+    float *p_batch = calloc((size_t)num_days * lanes, sizeof(float));
+    float *pmf_batch = malloc((size_t)(num_days + 1) * lanes * sizeof(float));
+    if (!p_batch || !pmf_batch){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    double loading = sqrt(rho);
+    double threshold_scale = 1.0 / sqrt(1.0 - rho);
+    for (int i = 0; i < num_days; i++){
+        double threshold = rain_threshold(p[i]);
+        for (int q = 0; q < lanes; q++){
+            p_batch[(size_t)i * lanes + q] = conditional_rain_probability(threshold, threshold_scale, loading, z[q]);
+        }
+    }
+
+    prob_mass_func_batch(p_batch, num_days, lanes, pmf_batch);
+    for (int k = 0; k <= num_days; k++){
+        double mixture = 0.0;
+        for (int q = 0; q < lanes; q++){
+            mixture += w[q] * pmf_batch[(size_t)k * lanes + q];
+        }
+        pmf[k] = (float)mixture;
+    }
+    free(p_batch);
+    free(pmf_batch);
+}
+
+float prob_rain_more_than_n_correlated(float *p, int n, float rho){
+    // prob_rain_more_than_n() with days correlated through a shared weather
+    // factor, rho in [0, 1), NAN for any other rho
+    if (!(rho >= 0.0f && rho < 1.0f)){
+        return NAN;
+    }
+    if (n < 0 || n >= DAYSPERYEAR){
+        return (n < 0) ? 1.0 : 0.0;
+    }
+
+    float pmf[DAYSPERYEAR + 1];
+    prob_mass_func_correlated(p, DAYSPERYEAR, rho, pmf);
+
+    float probability = 0.0;
+    for (int k = n + 1; k <= DAYSPERYEAR; k++){
+        probability += pmf[k];
+    }
+
+    return probability;
+}
+
+/*******************************************************************************
+ * RAGGED STATION BATCH
+ *******************************************************************************/
+typedef struct StationLength {
+    int station;
+    int64_t length;
+} StationLength;
+
+static int compare_by_length_descending(const void *a, const void *b){
+    const StationLength *x = (const StationLength *)a;
+    const StationLength *y = (const StationLength *)b;
+    if (x->length != y->length){
+        return (x->length < y->length) ? 1 : -1;
+    }
+    return x->station - y->station;
+}
+
+static void ragged_kernel(const float *p, const int64_t *offsets, int num_stations, const RainTuning *tuning,
+                          float *pmf){
+    // prob_mass_func_ragged() with the given configuration
+    StationLength *order = malloc((size_t)(num_stations > 0 ? num_stations : 1) * sizeof(StationLength));
+    if (!order){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < num_stations; s++){
+        order[s].station = s;
+        order[s].length = offsets[s + 1] - offsets[s];
+    }
+    qsort(order, num_stations, sizeof(StationLength), compare_by_length_descending);
+    int lanes_per_group = tuning->ragged_lanes;
+    int num_groups = (num_stations + lanes_per_group - 1) / lanes_per_group;
+    int64_t longest = (num_stations > 0) ? order[0].length : 0;
+
+    #pragma omp parallel
+    {
+        float *p_batch = malloc((size_t)(longest > 0 ? longest : 1) * lanes_per_group * sizeof(float));
+        float *pmf_batch = malloc((size_t)(longest + 1) * lanes_per_group * sizeof(float));
+        if (!p_batch || !pmf_batch){
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // groups are in descending cost, the first one is the longest
+        #pragma omp for schedule(dynamic, 1)
+        for (int g = 0; g < num_groups; g++){
+            const StationLength *group = order + (size_t)g * lanes_per_group;
+            int lanes = (num_stations - g * lanes_per_group < lanes_per_group)
+                            ? num_stations - g * lanes_per_group : lanes_per_group;
+            int64_t days = group[0].length;
+            for (int64_t i = 0; i < days; i++){
+                for (int l = 0; l < lanes_per_group; l++){
+                    int in_station = l < lanes && i < group[l].length;
+                    p_batch[i * lanes_per_group + l] = in_station ? p[offsets[group[l].station] + i] : 0.0f;
+                }
+            }
+            batch_kernel(p_batch, (int)days, lanes_per_group, tuning, pmf_batch);
+            for (int l = 0; l < lanes; l++){
+                int s = group[l].station;
+                float *out = pmf + offsets[s] + s;
+                for (int64_t k = 0; k <= group[l].length; k++){
+                    out[k] = pmf_batch[k * lanes_per_group + l];
+                }
+            }
+        }
+        free(p_batch);
+        free(pmf_batch);
+    }
+    free(order);
+}
+
+void prob_mass_func_ragged(const float *p, const int64_t *offsets, int num_stations, float *pmf){
+    // PMF of every station, see Solution 6)
+    ragged_kernel(p, offsets, num_stations, rain_tuning_get(), pmf);
+}
+
+void prob_rain_more_than_n_ragged(const float *p, const int64_t *offsets, int num_stations, const int *n,
+                                  float *probability){
+    // probability[s] = P(S > n[s]) over the days of station s
+    int64_t total = (num_stations > 0) ? offsets[num_stations] + num_stations : 1;
+    float *pmf = malloc((size_t)total * sizeof(float));
+    if (!pmf){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    prob_mass_func_ragged(p, offsets, num_stations, pmf);
+    for (int s = 0; s < num_stations; s++){
+        int64_t length = offsets[s + 1] - offsets[s];
+        const float *station_pmf = pmf + offsets[s] + s;
+        float tail = (n[s] < 0) ? 1.0f : 0.0f;
+        for (int64_t k = n[s] + 1; n[s] >= 0 && k <= length; k++){
+            tail += station_pmf[k];
+        }
+        probability[s] = tail;
+    }
+    free(pmf);
+}
+
+/*******************************************************************************
+ * TOP K STATIONS
+ *******************************************************************************/
+static double chernoff_log_bound(const float *p, int64_t length, double mu, double a){
+    // log of the Chernoff bound on P(S >= a) for a > mu, or on P(S <= a) for
+    // a < mu. Newton steps on t minimize -t a + sum log(1 - p + p e^t), any t
+    // on the right side of 0 gives a valid bound so only the last is evaluated
+    int upper = a > mu;
+    double t = (a > 0.0) ? log(a / mu) : -log(2.0 * (mu + 1.0)); // P(S <= 0): any t < 0
+    for (int step = 0; step < CHERNOFF_NEWTON_STEPS; step++){
+        double e = exp(t);
+        double mean = 0.0, variance = 0.0;
+        for (int64_t i = 0; i < length; i++){
+            double tilted = p[i] * e / (1.0 - p[i] + p[i] * e); // P(X_i = 1) tilted by t
+            mean += tilted;
+            variance += tilted * (1.0 - tilted);
+        }
+        if (variance <= 0.0){
+            break;
+        }
+        double next = t - (mean - a) / variance;
+        if ((upper && next <= 0.0) || (!upper && next >= 0.0)){
+            break;
+        }
+        t = next;
+    }
+    double e = exp(t), log_mgf = 0.0;
+    for (int64_t i = 0; i < length; i++){
+        log_mgf += log(1.0 - p[i] + p[i] * e);
+    }
+    return log_mgf - t * a;
+}
+
+static void normal_tail_bounds(const float *p, int64_t length, int n, double *lower, double *upper){
+    // one pass, no transcendental per day: Berry-Esseen around Phi
+    double mu = 0.0, variance = 0.0, third = 0.0;
+    for (int64_t i = 0; i < length; i++){
+        double q = p[i];
+        mu += q;
+        variance += q * (1 - q);
+        third += q * (1 - q) * (q * q + (1 - q) * (1 - q));
+    }
+    *lower = 0.0;
+    *upper = 1.0;
+    if (n < 0 || n >= length){
+        *lower = *upper = (n < 0) ? 1.0 : 0.0;
+    }
+    else if (variance > 0.0){
+        double sigma = sqrt(variance);
+        double error = BERRY_ESSEEN_CONSTANT * third / (variance * sigma);
+        double normal_lower = 1.0 - normal_cdf((n - mu) / sigma) - error;
+        double normal_upper = 1.0 - normal_cdf((n + 1 - mu) / sigma) + error;
+        *lower = (normal_lower > 0.0) ? normal_lower : 0.0;
+        *upper = (normal_upper < 1.0) ? normal_upper : 1.0;
+    }
+}
+
+static void chernoff_tail_bounds(const float *p, int64_t length, int n, double *lower, double *upper){
+    // tightens bounds from normal_tail_bounds, O(length) per Newton step
+    if (n < 0 || n >= length){
+        return;
+    }
+    double mu = 0.0;
+    for (int64_t i = 0; i < length; i++){
+        mu += p[i];
+    }
+    if (n + 1 > mu && mu > 0.0){
+        double chernoff_upper = exp(chernoff_log_bound(p, length, mu, n + 1));
+        *upper = (chernoff_upper < *upper) ? chernoff_upper : *upper;
+    }
+    if (n < mu){
+        double chernoff_lower = 1.0 - exp(chernoff_log_bound(p, length, mu, n));
+        *lower = (chernoff_lower > *lower) ? chernoff_lower : *lower;
+    }
+}
+
+void rain_tail_bounds(const float *p, int64_t length, int n, double *lower, double *upper){
+    // lower <= P(S > n) <= upper in O(length), see Solution 7)
+    normal_tail_bounds(p, length, n, lower, upper);
+    chernoff_tail_bounds(p, length, n, lower, upper);
+}
+
+typedef struct StationScore {
+    int station;
+    float probability;
+} StationScore;
+
+static int compare_by_score_descending(const void *a, const void *b){
+    const StationScore *x = (const StationScore *)a;
+    const StationScore *y = (const StationScore *)b;
+    if (x->probability != y->probability){
+        return (x->probability < y->probability) ? 1 : -1;
+    }
+    return x->station - y->station;
+}
+
+static double exact_engine_error(int64_t length){
+    // bound on |float P(S > n) - P(S > n)| over length days, see Solution 7)
+    return (EXACT_ROUNDINGS_PER_DAY + 1) * (double)length * FLT_EPSILON
+           + 2.0 * FLT_MIN * (double)length * (double)(length + 1);
+}
+
+static int compare_double_descending(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x < y) - (x > y);
+}
+
+static double kth_largest(const double *values, double *scratch, int count, int k){
+    for (int i = 0; i < count; i++){
+        scratch[i] = values[i];
+    }
+    qsort(scratch, count, sizeof(double), compare_double_descending);
+    return scratch[k - 1];
+}
+
+int top_k_stations(const float *p, const int64_t *offsets, int num_stations, int n, int k,
+                   int *stations, float *probability){
+    // the k stations with the highest P(S > n), best first, ties by station
+    // index. Returns the number of stations written, min(k, num_stations)
+    if (k > num_stations){
+        k = num_stations;
+    }
+    if (k <= 0){
+        return 0;
+    }
+    double *lower = malloc((size_t)num_stations * sizeof(double));
+    double *upper = malloc((size_t)num_stations * sizeof(double));
+    double *sorted = malloc((size_t)num_stations * sizeof(double));
+    if (!lower || !upper || !sorted){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int64_t longest = 0;
+    for (int s = 0; s < num_stations; s++){
+        longest = (offsets[s + 1] - offsets[s] > longest) ? offsets[s + 1] - offsets[s] : longest;
+    }
+    double slack = 2.0 * exact_engine_error(longest);
+
+    // the normal bounds are one cheap pass, Chernoff only runs on the
+    // stations they cannot settle against the k-th largest lower bound
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int s = 0; s < num_stations; s++){
+        normal_tail_bounds(p + offsets[s], offsets[s + 1] - offsets[s], n, &lower[s], &upper[s]);
+    }
+    double cutoff = kth_largest(lower, sorted, num_stations, k);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int s = 0; s < num_stations; s++){
+        if (upper[s] + slack >= cutoff && lower[s] < upper[s]){
+            chernoff_tail_bounds(p + offsets[s], offsets[s + 1] - offsets[s], n, &lower[s], &upper[s]);
+        }
+    }
+    cutoff = kth_largest(lower, sorted, num_stations, k);
+
+    // survivors are computed exactly in chunks, highest upper bound first,
+    // until no remaining upper bound can beat the k-th exact probability
+    int num_survivors = 0;
+    StationScore *order = malloc((size_t)num_stations * sizeof(StationScore));
+    StationScore *scores = malloc((size_t)num_stations * sizeof(StationScore));
+    int64_t *chunk_offsets = malloc((TOP_K_CHUNK + 1) * sizeof(int64_t));
+    int *chunk_station = malloc(TOP_K_CHUNK * sizeof(int));
+    int *chunk_n = malloc(TOP_K_CHUNK * sizeof(int));
+    float *exact = malloc(TOP_K_CHUNK * sizeof(float));
+    if (!order || !scores || !chunk_offsets || !chunk_station || !chunk_n || !exact){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < num_stations; s++){
+        if (upper[s] + slack >= cutoff){
+            order[num_survivors].station = s;
+            order[num_survivors].probability = (float)upper[s];
+            num_survivors++;
+        }
+    }
+    qsort(order, num_survivors, sizeof(StationScore), compare_by_score_descending);
+
+    float *chunk_p = NULL;
+    int64_t chunk_capacity = 0;
+    int num_scores = 0;
+    for (int first = 0; first < num_survivors; first += TOP_K_CHUNK){
+        if (num_scores >= k && upper[order[first].station] + slack < scores[k - 1].probability){
+            break;
+        }
+        int last = (num_survivors - first < TOP_K_CHUNK) ? num_survivors : first + TOP_K_CHUNK;
+        int count = 0;
+        chunk_offsets[0] = 0;
+        for (int j = first; j < last; j++){
+            // n outside [0, length) settles the bounds, no PMF needed
+            int s = order[j].station;
+            if (n < 0 || n >= offsets[s + 1] - offsets[s]){
+                scores[num_scores].station = s;
+                scores[num_scores].probability = (float)lower[s];
+                num_scores++;
+                continue;
+            }
+            chunk_station[count] = s;
+            chunk_offsets[count + 1] = chunk_offsets[count] + (offsets[s + 1] - offsets[s]);
+            chunk_n[count] = n;
+            count++;
+        }
+        if (chunk_offsets[count] > chunk_capacity){
+            chunk_capacity = chunk_offsets[count];
+            free(chunk_p);
+            chunk_p = malloc((size_t)chunk_capacity * sizeof(float));
+            if (!chunk_p){
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int j = 0; j < count; j++){
+            int s = chunk_station[j];
+            for (int64_t i = 0; i < chunk_offsets[j + 1] - chunk_offsets[j]; i++){
+                chunk_p[chunk_offsets[j] + i] = p[offsets[s] + i];
+            }
+        }
+        prob_rain_more_than_n_ragged(chunk_p, chunk_offsets, count, chunk_n, exact);
+        for (int j = 0; j < count; j++){
+            scores[num_scores].station = chunk_station[j];
+            scores[num_scores].probability = exact[j];
+            num_scores++;
+        }
+        qsort(scores, num_scores, sizeof(StationScore), compare_by_score_descending);
+    }
+    for (int j = 0; j < k; j++){
+        stations[j] = scores[j].station;
+        probability[j] = scores[j].probability;
+    }
+
+    free(lower);
+    free(upper);
+    free(sorted);
+    free(order);
+    free(scores);
+    free(chunk_offsets);
+    free(chunk_station);
+    free(chunk_n);
+    free(exact);
+    free(chunk_p);
+    return k;
+}
+
+/*******************************************************************************
+ * AUTOTUNING
+ *******************************************************************************/
+void rain_tuning_cpu_key(char *key, size_t size){
+    // "vendor:family:model" of the running CPU, see Solution 8)
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0, &eax, &ebx, &ecx, &edx)){
+        char vendor[13];
+        memcpy(vendor, &ebx, 4);
+        memcpy(vendor + 4, &edx, 4);
+        memcpy(vendor + 8, &ecx, 4);
+        vendor[12] = '\0';
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+        unsigned int family = (eax >> 8) & 0xf;
+        unsigned int model = (eax >> 4) & 0xf;
+        if (family == 0xf){
+            family += (eax >> 20) & 0xff;
+        }
+        if (family == 0x6 || family >= 0xf){
+            model |= ((eax >> 16) & 0xf) << 4;
+        }
+        snprintf(key, size, "%s:%u:%u", vendor, family, model);
+        return;
+    }
+#endif
+    snprintf(key, size, "unknown:0:0");
+}
+
+int rain_tuning_load(const char *path, const char *key, RainTuning *tuning){
+    // returns 1 and fills tuning if path has a valid record for key,
+    // the last record wins if a model was tuned more than once
+    FILE *file = fopen(path, "r");
+    if (!file){
+        return 0;
+    }
+    char line[256], record_key[TUNING_KEY_SIZE];
+    RainTuning record;
+    int found = 0;
+    while (fgets(line, sizeof(line), file)){
+        if (line[0] == '#'){
+            continue;
+        }
+        if (sscanf(line, "%63s %d %d", record_key, &record.ragged_lanes, &record.day_fusion) == 3 &&
+            strcmp(record_key, key) == 0 &&
+            (record.ragged_lanes == 4 || record.ragged_lanes == 8 || record.ragged_lanes == MAX_RAGGED_LANES) &&
+            (record.day_fusion == 1 || record.day_fusion == 2)){
+            *tuning = record;
+            found = 1;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+int rain_tuning_save(const char *path, const char *key, const RainTuning *tuning){
+    // appends a record, returns 0 if the database cannot be written
+    FILE *file = fopen(path, "a");
+    if (!file){
+        return 0;
+    }
+    if (ftell(file) == 0){
+        fprintf(file, "# cpu ragged_lanes day_fusion\n");
+    }
+    fprintf(file, "%s %d %d\n", key, tuning->ragged_lanes, tuning->day_fusion);
+    return fclose(file) == 0;
+}
+
+static double seconds_now(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+RainTuning rain_autotune(void){
+    // times every variant on a ragged workload of yearly, seasonal and
+    // short-range stations and returns the fastest, best of TUNING_REPEATS
+    const int num_stations = 96;
+    const int lengths[] = {DAYSPERYEAR, 180, 90, 14};
+    int64_t offsets[96 + 1];
+    offsets[0] = 0;
+    for (int s = 0; s < num_stations; s++){
+        offsets[s + 1] = offsets[s] + lengths[s % 4];
+    }
+    float *p = malloc((size_t)offsets[num_stations] * sizeof(float));
+    float *pmf = malloc((size_t)(offsets[num_stations] + num_stations) * sizeof(float));
+    if (!p || !pmf){
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // own generator, the benchmark must not move the rand() sequence
+    uint32_t state = 12345;
+    for (int64_t i = 0; i < offsets[num_stations]; i++){
+        state = state * 1664525u + 1013904223u;
+        p[i] = (float)(state >> 8) / (1 << 24);
+    }
+
+    const int lanes[] = {4, 8, MAX_RAGGED_LANES};
+    // each variant runs on a local configuration, the shared one is only
+    // written once tuning is done
+    RainTuning best = {RAGGED_LANES, 1};
+    double best_time = INFINITY;
+    for (int v = 0; v < 3; v++){
+        for (int fusion = 1; fusion <= 2; fusion++){
+            RainTuning variant = {lanes[v], fusion};
+            for (int r = 0; r < TUNING_REPEATS; r++){
+                double start = seconds_now();
+                ragged_kernel(p, offsets, num_stations, &variant, pmf);
+                double elapsed = seconds_now() - start;
+                if (elapsed < best_time){
+                    best_time = elapsed;
+                    best = variant;
+                }
+            }
+        }
+    }
+    free(p);
+    free(pmf);
+    return best;
+}
+
+int rain_tuning_path(char *path, size_t size){
+    // database path, see Solution 8), creating the cache directories
+    // returns 0 if there is no cache directory to use
+    const char *override = getenv("RAIN_TUNING_DB");
+    if (override && *override){
+        snprintf(path, size, "%s", override);
+        return 1;
+    }
+    char dir[4096];
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache && *cache == '/'){
+        snprintf(dir, sizeof(dir), "%s", cache);
+    }
+    else if (home && *home){
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    else {
+        return 0;
+    }
+    mkdir(dir, 0700); // fails harmlessly if it exists
+    size_t length = strlen(dir);
+    snprintf(dir + length, sizeof(dir) - length, "/%s", RAIN_TUNING_DIR);
+    mkdir(dir, 0700);
+    return snprintf(path, size, "%s/%s", dir, RAIN_TUNING_DB) < (int)size;
+}
+
+RainTuning rain_tuning_init(const char *path){
+    // returns the configuration of this CPU model loaded from path, or
+    // benchmarks and records it (path NULL: benchmarks without recording),
+    // see Solution 8)
+    char key[TUNING_KEY_SIZE];
+    rain_tuning_cpu_key(key, sizeof(key));
+    RainTuning tuning;
+    if (!path || !rain_tuning_load(path, key, &tuning)){
+        tuning = rain_autotune();
+        if (path && !rain_tuning_save(path, key, &tuning)){
+            fprintf(stderr, "Could not write tuning database %s\n", path);
+        }
+    }
+    return tuning;
+}
+
+const RainTuning *rain_tuning_get(void){
+    // tunes on the first use of the batch kernels, the configuration is
+    // published before the flag (release) and read after it (acquire), so
+    // no thread sees a partly written one
+    if (!atomic_load_explicit(&rain_tuning_ready, memory_order_acquire)){
+        #pragma omp critical(rain_tuning)
+        {
+            if (!atomic_load_explicit(&rain_tuning_ready, memory_order_relaxed)){
+                char path[4096];
+                rain_tuning = rain_tuning_init(rain_tuning_path(path, sizeof(path)) ? path : NULL);
+                atomic_store_explicit(&rain_tuning_ready, 1, memory_order_release);
+            }
+        }
+    }
+    return &rain_tuning;
+}
+
 /*******************************************************************************
  * CHECK SOLUTION WITH MONTE CARLO SIMULATION
  *******************************************************************************/
@@ -107,20 +1301,55 @@ float monte_carlo_prob_rain_more_than_n(float *p, int n, int num_simulations){
     return probability;
 }
 
+float monte_carlo_prob_rain_more_than_n_correlated(float *p, int n, float rho, int num_simulations){
+    // draw the weather factor of each year (Box-Muller), then the days given it
+    int num_years_rain_more_than_n = 0;
+    double loading = sqrt(rho);
+    double threshold_scale = 1.0 / sqrt(1.0 - rho);
+    float p_year[DAYSPERYEAR];
+    double threshold[DAYSPERYEAR];
+    for (int d = 0; d < DAYSPERYEAR; d++){
+        threshold[d] = rain_threshold(p[d]);
+    }
+
+    for (int i = 0; i < num_simulations; i++){
+        double u1 = ((double)rand() + 1) / ((double)RAND_MAX + 1);
+        double u2 = (double)rand() / RAND_MAX;
+        double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+        for (int d = 0; d < DAYSPERYEAR; d++){
+            p_year[d] = conditional_rain_probability(threshold[d], threshold_scale, loading, z);
+        }
+        if (simulate_year(p_year) > n){
+            num_years_rain_more_than_n++;
+        }
+    }
+
+    float probability = (float)num_years_rain_more_than_n/num_simulations;
+    return probability;
+}
+
 /*******************************************************************************
  * MAIN FUNCTION
  *******************************************************************************/
 int main(int argc, char *argv[]){
+    // rain_probability [n] [num_simulations] [rho]
     float p[DAYSPERYEAR];
     int n = 188;
     int num_simulations = 5000;
-    if (argc == 2){
+    float rho = 0.0;
+    if (argc >= 2){
         n = atoi(argv[1]);
     }
-    if (argc == 3){
-        n = atoi(argv[1]);
+    if (argc >= 3){
         num_simulations = atoi(argv[2]);
     }
+    if (argc >= 4){
+        rho = atof(argv[3]);
+        if (rho < 0.0f || rho >= 1.0f){
+            fprintf(stderr, "rho must be in [0, 1)\n");
+            return 1;
+        }
+    }
 
     // assign probability of rain for each day
     for (int i = 0; i < DAYSPERYEAR; i++){
@@ -134,5 +1363,24 @@ int main(int argc, char *argv[]){
     printf("Probability of raining on more than %d days: %f\n", n, probability1);
     printf("Monte Carlo Simulation results with %d iterations: %f\n", num_simulations, probability2);
 
+    uint64_t probability_fixed = prob_rain_more_than_n_fixed(p, n);
+    printf("Fixed-point (Q0.62) result: %.12f (0x%016llx)\n", q62_to_double(probability_fixed),
+           (unsigned long long)probability_fixed);
+
+    float lower, upper;
+    prob_rain_more_than_n_interval(p, n, &lower, &upper);
+    printf("Certified interval: [%.9f, %.9f]\n", lower, upper);
+
+    float by_day[DAYSPERYEAR];
+    prob_rain_more_than_n_by_day(p, n, by_day);
+    printf("Probability of raining on more than %d days by September 30: %f\n", n, by_day[272]);
+
+    if (argc >= 4){
+        float probability3 = prob_rain_more_than_n_correlated(p, n, rho);
+        float probability4 = monte_carlo_prob_rain_more_than_n_correlated(p, n, rho, num_simulations);
+        printf("Probability with correlated days (rho = %.2f): %f\n", rho, probability3);
+        printf("Monte Carlo Simulation results with %d iterations: %f\n", num_simulations, probability4);
+    }
+
     return 0;
 }
\ No newline at end of file
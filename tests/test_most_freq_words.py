@@ -0,0 +1,117 @@
+# Filename: test_most_freq_words.py
+# Author: Gary Atwal
+# Project: Picovoice Screening Questions
+#
+# Description:
+# Checks of most_freq_words.c through its command line, the program is built
+# once into a temporary directory
+#
+# Run:
+# python3 -m unittest discover tests
+#
+
+import os
+import re
+import subprocess
+import tempfile
+import unittest
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SOURCE = os.path.join(REPO, "most_freq_words.c")
+CORPUS = os.path.join(REPO, "shakespeare.txt")
+
+
+class MostFreqWordsTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.build_dir = tempfile.TemporaryDirectory()
+        cls.binary = os.path.join(cls.build_dir.name, "most_freq_words")
+        subprocess.run(["gcc", "-O2", "-fopenmp", SOURCE, "-o", cls.binary, "-lm"], check=True)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.build_dir.cleanup()
+
+    def run_program(self, *args: str) -> str:
+        result = subprocess.run([self.binary, *args], check=True, capture_output=True, text=True)
+        return result.stdout
+
+    def memory_used(self, output: str) -> int:
+        return int(re.search(r"Memory used: (\d+) of", output).group(1))
+
+    def ranked_counts(self, output: str) -> list:
+        return [int(line.split()[2]) for line in output.splitlines() if re.match(r"\d+: \S+ \d+$", line)]
+
+    def test_two_stage_counts_never_exceed_tokens(self):
+        for budget in ["120K", "200K", "300K", "1G"]:
+            output = self.run_program(CORPUS, "all", "--counts", "--stats", "--two-stage", "--memory-budget", budget)
+            tokens = int(re.search(r"Tokens: (\d+)", output).group(1))
+            self.assertLessEqual(sum(self.ranked_counts(output)), tokens, budget)
+
+    def test_two_stage_filter_fits_budget(self):
+        for budget, budget_bytes in [("100K", 100 << 10), ("120K", 120 << 10), ("200K", 200 << 10)]:
+            output = self.run_program(CORPUS, "10", "--two-stage", "--memory-budget", budget)
+            self.assertLessEqual(self.memory_used(output), budget_bytes, budget)
+
+    def test_longer_replacements_stay_within_budget(self):
+        # short words fill the table, then every long word replaces one of them
+        letters = [chr(ord("a") + i) for i in range(26)]
+        with tempfile.NamedTemporaryFile("w", suffix=".txt", dir=self.build_dir.name, delete=False) as corpus:
+            corpus.write(" ".join(a + b for a in letters for b in letters) + "\n")
+            for i in range(3000):
+                suffix = "".join(letters[(i // 26 ** k) % 26] for k in range(3))
+                corpus.write("w" * 137 + suffix + "\n")
+        output = self.run_program(corpus.name, "10", "--memory-budget", "120K")
+        self.assertIn("approximate", output)
+        self.assertLessEqual(self.memory_used(output), 120 << 10)
+
+    def test_two_stage_locations_fill_every_slot(self):
+        # each word is seen 5 times, its node is created on the second sighting
+        # and the 4 occurrences after the first fill the 4 location slots
+        words = ["w" + chr(ord("a") + i) for i in range(10)]
+        with tempfile.NamedTemporaryFile("w", suffix=".txt", dir=self.build_dir.name, delete=False) as corpus:
+            for _ in range(5):
+                corpus.write(" ".join(words) + "\n")
+        output = self.run_program(corpus.name, "10", "--locations", "--two-stage")
+        for line in output.splitlines():
+            if re.match(r"\d+: w", line):
+                lines = [location.split(":")[0] for location in line.split()[2:]]
+                self.assertEqual(lines, ["2", "3", "4", "5"], line)
+
+    def test_distinct_words_under_budget_are_estimated(self):
+        exact = self.run_program(CORPUS, "3", "--stats")
+        distinct = int(re.search(r"distinct words: (\d+)\n", exact).group(1))
+        for args in [("--memory-budget", "200000"), ("--two-stage", "--memory-budget", "90000")]:
+            output = self.run_program(CORPUS, "3", "--stats", *args)
+            self.assertIn("approximate", output)
+            match = re.search(r"distinct words: (\d+) \(HyperLogLog estimate", output)
+            self.assertIsNotNone(match, args)
+            self.assertLess(abs(int(match.group(1)) - distinct), 0.05 * distinct, args)
+
+    def test_bucketed_index_matches_in_memory_index(self):
+        # 2 threads keep the key counters at about 1.5 MB, 1700K is below the
+        # ~9 MB SA-IS needs, so the index is built in bucketed passes
+        in_memory = os.path.join(self.build_dir.name, "in_memory.idx")
+        bucketed = os.path.join(self.build_dir.name, "bucketed.idx")
+        self.run_program(CORPUS, "--build-index", in_memory)
+        result = subprocess.run([self.binary, CORPUS, "--build-index", bucketed, "--memory-budget", "1700K"],
+                                env=dict(os.environ, OMP_NUM_THREADS="2"), check=True, capture_output=True, text=True)
+        self.assertEqual(result.stderr, "")
+        with open(in_memory, "rb") as a, open(bucketed, "rb") as b:
+            self.assertEqual(a.read(), b.read())
+        self.assertEqual(self.run_program(CORPUS, "--query-index", bucketed, "the King"), "the King: 192\n")
+
+    def test_budget_below_table_overhead_is_rejected(self):
+        result = subprocess.run([self.binary, CORPUS, "3", "--memory-budget", "1K"], capture_output=True, text=True)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertIn("fixed table overhead", result.stderr)
+
+    def test_optional_node_arrays_cost_memory_only_when_enabled(self):
+        plain = self.memory_used(self.run_program(CORPUS, "3", "--memory-budget", "1G"))
+        tracked = self.memory_used(self.run_program(CORPUS, "3", "--memory-budget", "1G", "--original-case",
+                                                    "--locations"))
+        self.assertLess(plain, tracked)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,149 @@
+# Filename: test_phonemes_sequence.py
+# Author: Gary Atwal
+# Project: Picovoice Screening Questions
+#
+# Description:
+# Checks of phonemes_sequence.py, the native engine is built once into a
+# temporary directory when gcc is available
+#
+# Run:
+# python3 -m unittest discover tests
+#
+
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+from unittest import mock
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, REPO)
+
+import phonemes_sequence  # noqa: E402
+
+DICTIONARY = [("THEIR", ["DH", "EH", "R"]), ("THERE", ["DH", "EH", "R"]), ("THE", ["DH", "AH"]),
+              ("THEY", ["DH", "EY"]), ("TEAR", ["T", "EH", "R"]), ("DARE", ["D", "EH", "R"]),
+              ("AIR", ["EH", "R"]), ("ERR", ["ER"]), ("TEN", ["T", "EH", "N"]), ("DEN", ["D", "EH", "N"]),
+              ("THEN", ["DH", "EH", "N"]), ("DEAR", ["D", "IH", "R"]), ("RED", ["R", "EH", "D"])]
+
+
+class ApproximateMatchTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.build_dir = tempfile.TemporaryDirectory()
+        library = os.path.join(cls.build_dir.name, phonemes_sequence.NATIVE_LIBRARY)
+        if shutil.which("gcc") is None:
+            raise unittest.SkipTest("gcc is needed to build the native engine")
+        subprocess.run(["gcc", "-O2", "-shared", "-fPIC", os.path.join(REPO, "phonemes_trie.c"), "-o", library],
+                       check=True)
+        cls.library_dir = cls.build_dir.name
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.build_dir.cleanup()
+
+    def matches(self, phonemes, errors, native, dictionary=DICTIONARY):
+        index = phonemes_sequence.PronunciationIndex.from_dictionary(dictionary)
+        if native:
+            fake_source = os.path.join(self.library_dir, "phonemes_sequence.py")
+            with mock.patch.object(phonemes_sequence, "_native_library", None), \
+                 mock.patch.object(phonemes_sequence, "__file__", fake_source):
+                self.assertIsNotNone(phonemes_sequence._load_native_library())
+                return phonemes_sequence.find_approximate_word_matches(phonemes, errors, index)
+        with mock.patch.object(phonemes_sequence, "_native_library", False):
+            return phonemes_sequence.find_approximate_word_matches(phonemes, errors, index)
+
+    def test_max_cost_boundary_native_matches_python(self):
+        # three 0.1 substitutions sum to just above 0.3 in float
+        dictionary = [("ABC", ["A", "B", "C"]), ("X", ["X"])]
+        substitution = {(expected, "X"): 0.1 for expected in ["A", "B", "C"]}
+        errors = phonemes_sequence.PhonemeErrorModel(max_cost=0.3, substitution=substitution)
+        native = self.matches(["X", "X", "X"], errors, native=True, dictionary=dictionary)
+        self.assertEqual(native, self.matches(["X", "X", "X"], errors, native=False, dictionary=dictionary))
+
+    def test_random_inputs_native_matches_python(self):
+        rng = random.Random(7)
+        phonemes = sorted({phoneme for _, pronunciation in DICTIONARY for phoneme in pronunciation})
+        substitution = {(a, b): rng.choice([0.1, 0.3, 0.7]) for a in phonemes for b in phonemes if a != b}
+        insertion = {phoneme: rng.choice([0.2, 0.6]) for phoneme in phonemes}
+        errors = phonemes_sequence.PhonemeErrorModel(max_cost=0.9, substitution=substitution, insertion=insertion)
+        for _ in range(50):
+            sequence = [rng.choice(phonemes) for _ in range(rng.randint(1, 8))]
+            self.assertEqual(self.matches(sequence, errors, native=True),
+                             self.matches(sequence, errors, native=False), sequence)
+
+    def test_unknown_heard_phoneme_costs_apply(self):
+        errors = phonemes_sequence.PhonemeErrorModel(max_cost=0.5, insertion={"ZH": 0.25})
+        for native in [True, False]:
+            self.assertIn((0, 3, ["AIR"], 0.25), self.matches(["EH", "ZH", "R"], errors, native))
+        conflicting = phonemes_sequence.PhonemeErrorModel(insertion={"ZH": 0.25, "OY": 0.5})
+        with self.assertRaises(ValueError):
+            self.matches(["EH", "R"], conflicting, native=False)
+
+    def test_small_beam_native_matches_python(self):
+        inputs = [["DH", "EH", "R", "DH", "EH", "R"], ["T", "EH", "D", "EH", "N"], ["D", "EH", "R", "EH", "D"]]
+        for beam_width in [1, 2, 3]:
+            errors = phonemes_sequence.PhonemeErrorModel(max_cost=2.0, beam_width=beam_width)
+            for phonemes in inputs:
+                self.assertEqual(self.matches(phonemes, errors, native=True),
+                                 self.matches(phonemes, errors, native=False), (beam_width, phonemes))
+
+
+class PronunciationOrderTest(unittest.TestCase):
+    DICTIONARY = [("RED", ["R", "EH", "D"]), ("READ", ["R", "IY", "D"]), ("READ", ["R", "EH", "D"])]
+    EXPECTED = [("R", "IY", "D"), ("R", "EH", "D")]
+
+    def test_pronunciations_in_dictionary_order(self):
+        index = phonemes_sequence.PronunciationIndex.from_dictionary(self.DICTIONARY)
+        self.assertEqual(index.reverse.pronunciations("READ"), self.EXPECTED)
+
+    def test_compiled_pronunciations_in_dictionary_order(self):
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "dictionary.bin")
+            phonemes_sequence.PronunciationIndex.from_dictionary(self.DICTIONARY).compile(path)
+            index = phonemes_sequence.PronunciationIndex.load_compiled(path)
+            self.assertEqual(index.reverse.pronunciations("READ"), self.EXPECTED)
+
+    def test_saved_pronunciations_in_dictionary_order(self):
+        # B puts Z EH D first in phoneme_to_words, ZED keeps its own order
+        dictionary = [("B", ["Z", "EH", "D"]), ("ZED", ["Z", "IY"]), ("ZED", ["Z", "EH", "D"])]
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "dictionary.bin")
+            phonemes_sequence.PronunciationIndex.from_dictionary(dictionary).save(path)
+            index = phonemes_sequence.PronunciationIndex.load(path)
+            self.assertEqual(index.reverse.pronunciations("ZED"), [("Z", "IY"), ("Z", "EH", "D")])
+
+
+
+class StreamingSegmenterTest(unittest.TestCase):
+    def test_pending_hypotheses_stay_bounded(self):
+        # best paths to odd and even positions disagree from the first phoneme
+        index = phonemes_sequence.PronunciationIndex.from_dictionary([("A", ["AH"]), ("AA", ["AH", "AH"])])
+        unigram = phonemes_sequence.UnigramModel({"A": 1, "AA": 1000})
+        segmenter = phonemes_sequence.StreamingSegmenter(index, unigram, max_delay=16)
+        final = []
+        for _ in range(2000):
+            final += segmenter.push("AH")
+            self.assertLessEqual(segmenter.pending(), 17)
+        self.assertGreater(len(final), 900)
+
+    def test_same_cost_as_k_best_search(self):
+        phonemes = ["DH", "EH", "R", "D", "IH", "R", "T", "EH", "N", "R", "EH", "D"]
+        index = phonemes_sequence.PronunciationIndex.from_dictionary(DICTIONARY)
+        unigram = phonemes_sequence.UnigramModel({"THERE": 5, "DEAR": 2, "TEN": 3, "RED": 1})
+        segmenter = phonemes_sequence.StreamingSegmenter(index, unigram)
+        words = []
+        for phoneme in phonemes:
+            words += segmenter.push(phoneme)
+        cost = segmenter.cost()
+        words += segmenter.finish()
+        best_cost, best_words = phonemes_sequence.find_k_best_segmentations(phonemes, 1, unigram, index)[0]
+        self.assertAlmostEqual(cost, best_cost)
+        self.assertEqual(words, best_words)
+
+
+if __name__ == "__main__":
+    unittest.main()
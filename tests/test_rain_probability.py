@@ -0,0 +1,385 @@
+# Filename: test_rain_probability.py
+# Author: Gary Atwal
+# Project: Picovoice Screening Questions
+#
+# Description:
+# Checks of the engines in rain_probability.c against prob_mass_func_n(), the
+# source is built once into a shared library in a temporary directory and
+# called through ctypes. The tuning database is pinned to one configuration
+# so the batch kernels round the same way in every test
+#
+# Run:
+# python3 -m unittest discover tests
+#
+
+import ctypes
+from fractions import Fraction
+import math
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SOURCE = os.path.join(REPO, "rain_probability.c")
+DAYSPERYEAR = 365
+
+FloatArray = ctypes.POINTER(ctypes.c_float)
+Int64Array = ctypes.POINTER(ctypes.c_int64)
+IntArray = ctypes.POINTER(ctypes.c_int)
+
+
+class RainTuning(ctypes.Structure):
+    _fields_ = [("ragged_lanes", ctypes.c_int), ("day_fusion", ctypes.c_int)]
+
+
+# first use of the batch kernels from many threads in a fresh process, every
+# thread must see the one published configuration
+CONCURRENT_FIRST_USE = """
+import ctypes, sys, threading
+lib = ctypes.CDLL(sys.argv[1])
+lib.rain_tuning_get.restype = ctypes.POINTER(ctypes.c_int * 2)
+p = (ctypes.c_float * 2000)(*[(i % 97) / 97.0 for i in range(2000)])
+offsets = (ctypes.c_int64 * 11)(*range(0, 2001, 200))
+results, seen = [], []
+def run():
+    pmf = (ctypes.c_float * 2010)()
+    lib.prob_mass_func_ragged(p, offsets, 10, pmf)
+    results.append(list(pmf))
+    seen.append(tuple(lib.rain_tuning_get().contents))
+threads = [threading.Thread(target=run) for _ in range(8)]
+for thread in threads:
+    thread.start()
+for thread in threads:
+    thread.join()
+assert all(result == results[0] for result in results)
+assert len(set(seen)) == 1
+print(*seen[0])
+"""
+
+
+def floats(values):
+    return (ctypes.c_float * len(values))(*values)
+
+
+def exact_pmf(p):
+    # Poisson binomial PMF of the float p in rationals
+    pmf = [Fraction(1)]
+    for q in map(Fraction, p):
+        pmf = [(1 - q) * a + q * b for a, b in zip(pmf + [0], [0] + pmf)]
+    return pmf
+
+
+def random_probabilities(rng, count):
+    # float-representable, so Python and C start from the same p
+    return [ctypes.c_float(rng.random()).value for _ in range(count)]
+
+
+class RainProbabilityTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        if shutil.which("gcc") is None:
+            raise unittest.SkipTest("gcc is needed to build rain_probability.c")
+        cls.build_dir = tempfile.TemporaryDirectory()
+        library = os.path.join(cls.build_dir.name, "librain_probability.so")
+        subprocess.run(["gcc", "-O2", "-fopenmp", "-frounding-math", "-shared", "-fPIC", SOURCE, "-o", library,
+                        "-lm"], check=True)
+        cls.lib = ctypes.CDLL(library)
+        lib = cls.lib
+        lib.prob_mass_func_n.argtypes = [FloatArray, ctypes.c_int, FloatArray]
+        lib.prob_mass_func_n.restype = None
+        lib.prob_mass_func_correlated.argtypes = [FloatArray, ctypes.c_int, ctypes.c_float, FloatArray]
+        lib.prob_mass_func_correlated.restype = None
+        lib.prob_rain_more_than_n_correlated.argtypes = [FloatArray, ctypes.c_int, ctypes.c_float]
+        lib.prob_rain_more_than_n_correlated.restype = ctypes.c_float
+        lib.prob_mass_func_triangle.argtypes = [FloatArray, ctypes.c_int, FloatArray]
+        lib.prob_mass_func_triangle.restype = None
+        lib.prob_rain_more_than_thresholds_by_day.argtypes = [FloatArray, ctypes.c_int, IntArray, ctypes.c_int,
+                                                              FloatArray]
+        lib.prob_rain_more_than_thresholds_by_day.restype = None
+        lib.prob_rain_more_than_n_by_day.argtypes = [FloatArray, ctypes.c_int, FloatArray]
+        lib.prob_rain_more_than_n_by_day.restype = None
+        lib.probability_to_q62.argtypes = [ctypes.c_float]
+        lib.probability_to_q62.restype = ctypes.c_uint64
+        lib.q62_to_double.argtypes = [ctypes.c_uint64]
+        lib.q62_to_double.restype = ctypes.c_double
+        lib.prob_mass_func_fixed.argtypes = [ctypes.POINTER(ctypes.c_uint64), ctypes.c_int,
+                                             ctypes.POINTER(ctypes.c_uint64)]
+        lib.prob_mass_func_fixed.restype = None
+        lib.prob_rain_more_than_n_fixed.argtypes = [FloatArray, ctypes.c_int]
+        lib.prob_rain_more_than_n_fixed.restype = ctypes.c_uint64
+        lib.prob_mass_func_ragged.argtypes = [FloatArray, Int64Array, ctypes.c_int, FloatArray]
+        lib.prob_mass_func_ragged.restype = None
+        lib.prob_mass_func_interval.argtypes = [FloatArray, ctypes.c_int, FloatArray, FloatArray]
+        lib.prob_mass_func_interval.restype = None
+        lib.prob_rain_more_than_n_interval.argtypes = [FloatArray, ctypes.c_int, FloatArray, FloatArray]
+        lib.prob_rain_more_than_n_interval.restype = None
+        lib.prob_rain_more_than_n_ragged.argtypes = [FloatArray, Int64Array, ctypes.c_int, IntArray, FloatArray]
+        lib.prob_rain_more_than_n_ragged.restype = None
+        lib.top_k_stations.argtypes = [FloatArray, Int64Array, ctypes.c_int, ctypes.c_int, ctypes.c_int, IntArray,
+                                       FloatArray]
+        lib.top_k_stations.restype = ctypes.c_int
+        lib.rain_tuning_cpu_key.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+        lib.rain_tuning_cpu_key.restype = None
+        lib.rain_tuning_save.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(RainTuning)]
+        lib.rain_tuning_save.restype = ctypes.c_int
+        lib.rain_tuning_load.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(RainTuning)]
+        lib.rain_tuning_load.restype = ctypes.c_int
+        lib.rain_tuning_init.argtypes = [ctypes.c_char_p]
+        lib.rain_tuning_init.restype = RainTuning
+        cls.library = library
+
+        # one day per sweep, the batch kernels then round like prob_mass_func_n()
+        key = ctypes.create_string_buffer(64)
+        lib.rain_tuning_cpu_key(key, len(key))
+        cls.tuning_db = os.path.join(cls.build_dir.name, "rain_tuning.db")
+        lib.rain_tuning_save(cls.tuning_db.encode(), key.value, ctypes.byref(RainTuning(8, 1)))
+        os.environ["RAIN_TUNING_DB"] = cls.tuning_db
+
+    @classmethod
+    def tearDownClass(cls):
+        os.environ.pop("RAIN_TUNING_DB", None)
+        cls.build_dir.cleanup()
+
+    def pmf(self, p):
+        pmf = (ctypes.c_float * (len(p) + 1))()
+        self.lib.prob_mass_func_n(floats(p), len(p), pmf)
+        return list(pmf)
+
+    def tail(self, p, n):
+        # P(S > n) from prob_mass_func_n()
+        if n < 0 or n >= len(p):
+            return 1.0 if n < 0 else 0.0
+        return sum(self.pmf(p)[n + 1:])
+
+    def ragged(self, stations):
+        offsets = [0]
+        for p in stations:
+            offsets.append(offsets[-1] + len(p))
+        flat = floats([q for p in stations for q in p])
+        return flat, (ctypes.c_int64 * len(offsets))(*offsets)
+
+    def test_correlated_without_correlation_is_independent(self):
+        rng = random.Random(116)
+        p = random_probabilities(rng, DAYSPERYEAR)
+        pmf = (ctypes.c_float * (DAYSPERYEAR + 1))()
+        self.lib.prob_mass_func_correlated(floats(p), DAYSPERYEAR, 0.0, pmf)
+        for k, expected in enumerate(self.pmf(p)):
+            self.assertAlmostEqual(pmf[k], expected, delta=1e-5, msg=k)
+        for n in [-1, 0, 150, 182, 200, 364, 365]:
+            self.assertAlmostEqual(self.lib.prob_rain_more_than_n_correlated(floats(p), n, 0.0),
+                                   self.tail(p, n), delta=1e-5, msg=n)
+
+    def test_correlation_widens_the_distribution(self):
+        rng = random.Random(1160)
+        p = random_probabilities(rng, DAYSPERYEAR)
+        mean = sum(p)
+        independent = sum(q * (1 - q) for q in p)
+        for rho in [0.1, 0.5, 0.9]:
+            pmf = (ctypes.c_float * (DAYSPERYEAR + 1))()
+            self.lib.prob_mass_func_correlated(floats(p), DAYSPERYEAR, rho, pmf)
+            self.assertAlmostEqual(sum(pmf), 1.0, delta=1e-4, msg=rho)
+            # the factor keeps each day's marginal, so the mean stays
+            self.assertAlmostEqual(sum(k * pmf[k] for k in range(len(pmf))), mean, delta=0.05 * mean, msg=rho)
+            variance = sum((k - mean) ** 2 * pmf[k] for k in range(len(pmf)))
+            self.assertGreater(variance, independent, rho)
+
+    def test_correlation_outside_unit_interval_is_nan(self):
+        p = floats([0.5] * DAYSPERYEAR)
+        for rho in [-0.5, -1e-7, 1.0, 1.5, float("inf"), float("nan")]:
+            self.assertTrue(math.isnan(self.lib.prob_rain_more_than_n_correlated(p, 100, rho)), rho)
+
+    def test_triangle_rows_are_prefix_pmfs(self):
+        rng = random.Random(117)
+        p = random_probabilities(rng, 120)
+        triangle = (ctypes.c_float * ((len(p) + 1) * (len(p) + 2) // 2))()
+        self.lib.prob_mass_func_triangle(floats(p), len(p), triangle)
+        for d in range(len(p) + 1):
+            row = triangle[d * (d + 1) // 2:d * (d + 1) // 2 + d + 1]
+            for k, expected in enumerate(self.pmf(p[:d])):
+                self.assertAlmostEqual(row[k], expected, delta=1e-6, msg=(d, k))
+
+    def test_thresholds_by_day_match_prefix_tails(self):
+        rng = random.Random(1170)
+        p = random_probabilities(rng, 150)
+        n = [-1, 0, 3, 40, 75, 149, 150]
+        probability = (ctypes.c_float * (len(p) * len(n)))()
+        self.lib.prob_rain_more_than_thresholds_by_day(floats(p), len(p), (ctypes.c_int * len(n))(*n), len(n),
+                                                       probability)
+        for d in range(len(p)):
+            for t, threshold in enumerate(n):
+                self.assertAlmostEqual(probability[d * len(n) + t], self.tail(p[:d + 1], threshold), delta=1e-5,
+                                       msg=(d, threshold))
+
+        # the year version ends at the full-year tail
+        year = random_probabilities(rng, DAYSPERYEAR)
+        by_day = (ctypes.c_float * DAYSPERYEAR)()
+        self.lib.prob_rain_more_than_n_by_day(floats(year), 180, by_day)
+        self.assertAlmostEqual(by_day[DAYSPERYEAR - 1], self.tail(year, 180), delta=1e-5)
+        self.assertEqual(list(by_day), sorted(by_day))
+
+    def test_q62_conversion_rounds_to_nearest(self):
+        to_q62 = self.lib.probability_to_q62
+        self.assertEqual(to_q62(0.0), 0)
+        self.assertEqual(to_q62(-0.5), 0)
+        self.assertEqual(to_q62(1.0), 1 << 62)
+        self.assertEqual(to_q62(2.0), 1 << 62)
+        self.assertEqual(to_q62(0.5), 1 << 61)
+        self.assertEqual(to_q62(2.0 ** -39 * (1 + 2.0 ** -23)), (1 << 23) + 1)  # exact down to 2^-39
+        self.assertEqual(to_q62(2.0 ** -62), 1)
+        self.assertEqual(to_q62(2.0 ** -63), 1)  # half up
+        self.assertEqual(to_q62(0.75 * 2.0 ** -63), 0)
+        self.assertEqual(to_q62(1.5 * 2.0 ** -62), 2)
+        self.assertEqual(to_q62(2.0 ** -70), 0)
+        rng = random.Random(118)
+        for p in random_probabilities(rng, 1000):
+            self.assertEqual(to_q62(p), round(p * 2 ** 62), p)
+
+    def test_fixed_point_matches_float_engine(self):
+        rng = random.Random(1180)
+        p = random_probabilities(rng, DAYSPERYEAR)
+        p_fixed = (ctypes.c_uint64 * len(p))(*[self.lib.probability_to_q62(q) for q in p])
+        pmf_fixed = (ctypes.c_uint64 * (len(p) + 1))()
+        self.lib.prob_mass_func_fixed(p_fixed, len(p), pmf_fixed)
+        for k, expected in enumerate(self.pmf(p)):
+            self.assertAlmostEqual(self.lib.q62_to_double(pmf_fixed[k]), expected, delta=1e-6, msg=k)
+        for n in [-1, 0, 100, 182, 250, 364, 365]:
+            fixed = self.lib.prob_rain_more_than_n_fixed(floats(p), n)
+            self.assertAlmostEqual(self.lib.q62_to_double(fixed), self.tail(p, n), delta=1e-5, msg=n)
+            self.assertEqual(self.lib.prob_rain_more_than_n_fixed(floats(p), n), fixed, n)
+
+    def test_ragged_stations_match_single_station_engine(self):
+        rng = random.Random(119)
+        # more stations than one group of lanes, lengths from empty to a year
+        stations = [random_probabilities(rng, rng.choice([0, 1, 2, 7, 30, 200, DAYSPERYEAR])) for _ in range(37)]
+        p, offsets = self.ragged(stations)
+        pmf = (ctypes.c_float * (offsets[len(stations)] + len(stations)))()
+        self.lib.prob_mass_func_ragged(p, offsets, len(stations), pmf)
+        for s, station in enumerate(stations):
+            start = offsets[s] + s
+            for k, expected in enumerate(self.pmf(station)):
+                self.assertAlmostEqual(pmf[start + k], expected, delta=1e-6, msg=(s, k))
+
+        n = [rng.randint(-1, len(station)) for station in stations]
+        probability = (ctypes.c_float * len(stations))()
+        self.lib.prob_rain_more_than_n_ragged(p, offsets, len(stations), (ctypes.c_int * len(n))(*n), probability)
+        for s, station in enumerate(stations):
+            self.assertAlmostEqual(probability[s], self.tail(station, n[s]), delta=1e-5, msg=s)
+
+    def records(self, path):
+        with open(path) as database:
+            return [line.split() for line in database if not line.startswith("#")]
+
+    def test_tuning_is_recorded_once_per_cpu_model(self):
+        path = os.path.join(self.build_dir.name, "fresh_tuning.db")
+        key = ctypes.create_string_buffer(64)
+        self.lib.rain_tuning_cpu_key(key, len(key))
+        tuned = self.lib.rain_tuning_init(path.encode())
+        self.assertIn(tuned.ragged_lanes, [4, 8, 16])
+        self.assertIn(tuned.day_fusion, [1, 2])
+        self.assertEqual(self.records(path), [[key.value.decode(), str(tuned.ragged_lanes), str(tuned.day_fusion)]])
+
+        # the second run loads the record instead of benchmarking again
+        loaded = self.lib.rain_tuning_init(path.encode())
+        self.assertEqual((loaded.ragged_lanes, loaded.day_fusion), (tuned.ragged_lanes, tuned.day_fusion))
+        self.assertEqual(len(self.records(path)), 1)
+
+        # invalid and foreign records are skipped, the last valid one wins
+        with open(path, "a") as database:
+            database.write(f"{key.value.decode()} 5 1\nother:0:0 4 2\n{key.value.decode()} 4 2\n")
+        record = RainTuning()
+        self.assertEqual(self.lib.rain_tuning_load(path.encode(), key.value, ctypes.byref(record)), 1)
+        self.assertEqual((record.ragged_lanes, record.day_fusion), (4, 2))
+        self.assertEqual(self.lib.rain_tuning_load(path.encode(), b"missing:0:0", ctypes.byref(record)), 0)
+
+    def test_concurrent_first_use_publishes_one_configuration(self):
+        path = os.path.join(self.build_dir.name, "concurrent_tuning.db")
+        environment = dict(os.environ, RAIN_TUNING_DB=path, OMP_NUM_THREADS="2")
+        result = subprocess.run([sys.executable, "-c", CONCURRENT_FIRST_USE, self.library], env=environment,
+                                check=True, capture_output=True, text=True)
+        records = self.records(path)
+        self.assertEqual(len(records), 1)
+        self.assertEqual(result.stdout.split(), records[0][1:])
+
+    def test_interval_pmf_contains_exact_pmf(self):
+        rng = random.Random(122)
+        # some days certain or impossible, and tails far below FLT_MIN
+        p = random_probabilities(rng, 60) + [ctypes.c_float(q).value for q in [0.0, 1.0, 1e-30, 0.999999]]
+        lower = (ctypes.c_float * (len(p) + 1))()
+        upper = (ctypes.c_float * (len(p) + 1))()
+        self.lib.prob_mass_func_interval(floats(p), len(p), lower, upper)
+        pmf = self.pmf(p)
+        for k, exact in enumerate(exact_pmf(p)):
+            self.assertLessEqual(Fraction(lower[k]), exact, k)
+            self.assertGreaterEqual(Fraction(upper[k]), exact, k)
+            self.assertLessEqual(upper[k] - lower[k], 1e-6 + 1e-5 * pmf[k], k)
+
+    def test_interval_tail_contains_exact_tail(self):
+        rng = random.Random(1220)
+        p = random_probabilities(rng, DAYSPERYEAR)
+        pmf = exact_pmf(p)
+        lower, upper = ctypes.c_float(), ctypes.c_float()
+        for n in [-1, 0, 1, 100, 170, 182, 200, 300, 364, 365]:
+            self.lib.prob_rain_more_than_n_interval(floats(p), n, ctypes.byref(lower), ctypes.byref(upper))
+            exact = sum(pmf[n + 1:]) if n >= 0 else Fraction(1)
+            self.assertLessEqual(Fraction(lower.value), exact, n)
+            self.assertGreaterEqual(Fraction(upper.value), exact, n)
+            # a few float steps of width per day
+            self.assertLessEqual(upper.value - lower.value, 4 * DAYSPERYEAR * 2.0 ** -23, n)
+            self.assertAlmostEqual(self.tail(p, n), float(exact), delta=1e-5, msg=n)
+
+    def test_top_k_matches_brute_force_ranking(self):
+        rng = random.Random(120)
+        for trial in range(6):
+            # wetter and drier stations with different horizons, n near the
+            # middle so many bounds overlap the cutoff
+            stations = []
+            for _ in range(rng.randint(50, 700)):
+                wetness = rng.random()
+                stations.append([ctypes.c_float(wetness * rng.random()).value
+                                 for _ in range(rng.randint(1, 400))])
+            n = rng.randint(-1, 150)
+            k = rng.choice([1, 5, 20, len(stations) + 3])
+            p, offsets = self.ragged(stations)
+
+            thresholds = (ctypes.c_int * len(stations))(*([n] * len(stations)))
+            exact = (ctypes.c_float * len(stations))()
+            self.lib.prob_rain_more_than_n_ragged(p, offsets, len(stations), thresholds, exact)
+            expected = sorted(range(len(stations)), key=lambda s: (-exact[s], s))[:k]
+
+            top = (ctypes.c_int * k)()
+            probability = (ctypes.c_float * k)()
+            count = self.lib.top_k_stations(p, offsets, len(stations), n, k, top, probability)
+            self.assertEqual(count, min(k, len(stations)), trial)
+            self.assertEqual(list(top)[:count], expected, trial)
+            self.assertEqual(list(probability)[:count], [exact[s] for s in expected], trial)
+
+    def test_top_k_separates_near_ties(self):
+        # copies of one station one float step apart on a single day, the
+        # tails differ by far less than the bounds can resolve
+        rng = random.Random(7)
+        base = random_probabilities(rng, 300)
+        stations = []
+        for s in range(64):
+            p = list(base)
+            day = rng.randrange(len(p))
+            p[day] = ctypes.c_float(p[day] * (1 + (s - 32) * 2 ** -23)).value
+            stations.append(p)
+        n = 150
+        p, offsets = self.ragged(stations)
+        thresholds = (ctypes.c_int * len(stations))(*([n] * len(stations)))
+        exact = (ctypes.c_float * len(stations))()
+        self.lib.prob_rain_more_than_n_ragged(p, offsets, len(stations), thresholds, exact)
+        k = 10
+        expected = sorted(range(len(stations)), key=lambda s: (-exact[s], s))[:k]
+        top = (ctypes.c_int * k)()
+        probability = (ctypes.c_float * k)()
+        self.lib.top_k_stations(p, offsets, len(stations), n, k, top, probability)
+        self.assertEqual(list(top), expected)
+
+
+if __name__ == "__main__":
+    unittest.main()